@@ -1,569 +1,6100 @@
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/cache.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/errno.h>
+#include <linux/filter.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/minmax.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/poll.h>
 #include <linux/printk.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/sysfs.h>
+#include <linux/timer.h>
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 
+#include "kpub.h"
+
 #define NUM_TOPICS 256
 #define MAX_STR_LEN 63
 #define MAX_BUF_SIZE PAGE_SIZE
+#define MAX_LOCKED_COPY (4 * PAGE_SIZE)
+#define NUM_SNAPS 3
+#define MAX_CURSORS 32
+#define NUM_WAIT_BUCKETS 24
+#define MAX_DELAYED (1 << 20)
+#define DELAY_RETRY_NS (100 * NSEC_PER_USEC)
+#define MAX_RATE (U64_MAX / NSEC_PER_SEC)
+
+/*
+ * A rate limit, kept as the time its token bucket would be full again (the
+ * generic cell rate algorithm) rather than a token count, so that taking
+ * tokens is a single cmpxchg and nothing needs refilling.
+ */
+struct kpub_limit {
+	u64 rate;
+	atomic64_t tat;
+};
+
+/* Message and byte rate limits, and whether writes over them fail. */
+struct kpub_limits {
+	struct kpub_limit msgs, bytes;
+	bool reject;
+};
+
+/* One version of a snapshot topic's state. */
+struct kpub_snap {
+	seqcount_t seq;
+	u64 gen;
+	char *data;
+};
+
+/*
+ * Topic state is grouped by who writes it. The producer and consumer sections
+ * each start on their own cache line so that a writer publishing on one CPU
+ * and a reader consuming on another do not invalidate each other's lines on
+ * every message. wp is a free-running message counter and a message's slot is
+ * its counter modulo msg_count.
+ *
+ * Each reader keeps its own cursor in its struct kpub_file. Producers cache
+ * the slowest cursor in tail and only rescan the readers when the ring looks
+ * full, so reader progress never writes to the producer's cache line.
+ *
+ * Producers are serialized by an IRQ-safe spinlock so that publishing never
+ * sleeps once a slot is free. Readers copy out of [rp, wp) without the
+ * spinlock, since producers never touch slots a reader has not consumed.
+ *
+ * Consumed slots keep their messages until they are reused, so the last
+ * msg_count messages since the buffer was allocated at base stay readable
+ * for readers that seek back to them.
+ */
+struct topic {
+	/* Producer-owned, written by every publish. */
+	u64 wp ____cacheline_aligned_in_smp;
+	u64 tail, base;
+	spinlock_t lock;
+	unsigned long dropped, evicted;
+	wait_queue_head_t inq;
+	struct list_head readers;
+
+	/* Wakes readers on behalf of publishers in NMI context. */
+	struct irq_work wake_work;
+
+	/* Writers waiting for room, served in order. */
+	struct list_head wqueue;
+	size_t nqueued;
+
+	/* Consumer-owned, woken by readers as they make room. */
+	wait_queue_head_t outq ____cacheline_aligned_in_smp;
+
+	/* Serializes configuration changes. */
+	struct mutex mtx ____cacheline_aligned_in_smp;
+
+	/* Configuration, read-mostly once the buffer is allocated. */
+	size_t msg_size ____cacheline_aligned_in_smp;
+	size_t msg_count, msg_stride, hdr_size;
+	bool pad_slots, latched;
+	unsigned int ack_timeout_ms;
+
+	/* How long queued writers waited, in log2 microsecond buckets. */
+	atomic_long_t wait_hist[NUM_WAIT_BUCKETS];
+
+	/* Rate limits shared by all writers, and how often they applied. */
+	struct kpub_limits limits ____cacheline_aligned_in_smp;
+	atomic_long_t throttled;
+
+	/*
+	 * Default time to live of messages, whether any message was given
+	 * one, and how many expired messages readers skipped.
+	 */
+	u64 ttl_us;
+	bool ttls;
+	atomic_long_t expired;
+
+	/* Lag limits past which a reader stops holding producers back. */
+	size_t max_lag;
+	unsigned int max_lag_ms;
+
+	/*
+	 * Messages held until they are due, in a min-heap by delivery time
+	 * under delay_lock, their size, and the timer armed for the earliest.
+	 * delay_lock nests outside the producer lock.
+	 */
+	spinlock_t delay_lock;
+	struct kpub_delayed **delayed;
+	size_t ndelayed, delay_cap, delay_bytes;
+	u64 delay_seq;
+	struct hrtimer delay_timer;
+	char *buf;
+	struct kpub_stamp *stamps;
+
+	/*
+	 * Partitions or priority lanes, which are topics of their own named
+	 * <name>/<n>. Writes to the topic are routed to them and it has no
+	 * ring. Lanes are also read through the topic, higher lanes first.
+	 */
+	struct topic **parts;
+	size_t nparts;
+	atomic_t rr;
+	bool lanes;
+
+	/*
+	 * Compaction index, for topics with a key. Maps each key to the slot
+	 * holding its latest value; superseded slots are unhashed.
+	 */
+	size_t key_offset, key_len, nlive;
+	struct hlist_head *keys;
+	struct kpub_key *key_nodes;
+	unsigned int key_bits;
+
+	/*
+	 * Snapshot topics hold the latest of NUM_SNAPS versions instead of a
+	 * ring. Writers fill the oldest version under snap_mtx, never waiting
+	 * for readers, and publish it by index. Readers copy the latest version
+	 * without locks and retry if a writer reused it meanwhile.
+	 */
+	struct mutex snap_mtx ____cacheline_aligned_in_smp;
+	struct kpub_snap snaps[NUM_SNAPS];
+	unsigned int snap_latest;
+	u64 snap_gen;
+	char *snap_buf;
+	bool snapshot;
+
+	/* Kernel subscribers, walked under RCU on every publish. */
+	struct list_head subs;
+
+	/* Set members waiting for the buffer to be allocated. */
+	struct list_head watchers;
+
+	/* Consumer groups, under mtx. */
+	struct list_head groups;
+
+	/* Durable cursors, under mtx. */
+	struct list_head cursors;
+	size_t ncursors;
+
+	/* Cold device state, only touched on open, close and sysfs access. */
+	size_t nreaders, nwriters, nkernel;
+	struct topic *parent;
+	struct trie_node *node;
+	char name[MAX_STR_LEN];
+	struct device dev;
+	struct cdev cdev;
+	struct list_head entry;
+};
+
+#define cdev_to_topic(ptr) container_of(ptr, struct topic, cdev);
+#define dev_to_topic(ptr) container_of(ptr, struct topic, dev);
+#define node_to_topic(ptr) list_entry(ptr, struct topic, entry);
+
+/*
+ * When a message was published, and when it expires or 0 if it does not,
+ * stored alongside its slot.
+ */
+struct kpub_stamp {
+	u64 seq;
+	u64 ns;
+	u64 expires;
+};
+
+/*
+ * A slot's entry in the compaction index. orig is the sequence number the
+ * message was first published at, which stays the same as it is carried
+ * forward around the ring.
+ */
+struct kpub_key {
+	struct hlist_node node;
+	u64 orig;
+};
+
+/*
+ * A message held until at, a CLOCK_MONOTONIC time in nanoseconds. seq orders
+ * messages due at the same time as they were written.
+ */
+struct kpub_delayed {
+	u64 at;
+	u64 seq;
+	u64 ttl;
+	char msg[];
+};
+
+/* A kernel subscriber registered with kpub_subscribe_cb. */
+struct kpub_sub {
+	struct topic *topic;
+	kpub_cb_t cb;
+	void *priv;
+	struct list_head entry;
+};
+
+/* Per-file state for a topic opened for reading or writing. */
+struct kpub_file {
+	struct topic *topic;
+
+	/* Reader cursor, on its own line since every read advances it. */
+	u64 rp ____cacheline_aligned_in_smp;
+
+	/* Where the reader started, to tell which carried messages it saw. */
+	u64 start;
+
+	/*
+	 * Set by a producer that evicted the reader for lagging, under the
+	 * topic's lock, with the position it moved the reader to.
+	 */
+	u64 lag_to;
+	bool lagged, evictable;
+
+	/* Generation of the last snapshot read. */
+	u64 gen;
+
+	/* Consumer group this reader reads through, fixed once joined. */
+	struct kpub_group *group;
+
+	/* Durable cursor this reader commits to, fixed once attached. */
+	struct kpub_cursor *cursor;
+
+	/*
+	 * Serializes reads and filter changes on this file. Filters are also
+	 * run under RCU by producers deciding whether to wake the reader.
+	 */
+	struct mutex mtx;
+	struct bpf_prog __rcu *filter;
+	struct kpub_preds __rcu *preds;
+
+	/* On the topic's readers, or its watchers while watching is set. */
+	struct list_head entry;
+	bool watching;
+
+	/* Whether reads return each message with its header. */
+	bool header;
+
+	/* Rate limits of this writer. */
+	struct kpub_limits limits;
+
+	/* Time to live of the messages a writer publishes, 0 for the default. */
+	u64 ttl_ns;
+
+	/* When the messages a writer publishes are delivered, 0 for now. */
+	u64 deliver_at;
+
+	/* Lane a writer publishes to, or a reader's cursor in each lane. */
+	u32 lane;
+	struct kpub_file *lanes;
+};
+
+/*
+ * Content predicates compiled from struct kpub_pred, sorted by comparison so
+ * that each group folds into a single miss word with a branch-free loop.
+ * Predicates [end[op - 1], end[op]) use comparison op.
+ */
+struct kpub_preds {
+	struct rcu_head rcu;
+	u32 end[KPUB_PRED_NR_OPS];
+	u32 off[KPUB_MAX_PREDS];
+	u64 mask[KPUB_MAX_PREDS];
+	u64 value[KPUB_MAX_PREDS];
+};
+
+/*
+ * A consumer group: readers sharing one cursor, so that each message is read
+ * by exactly one of them. The group's cursor sits on the topic's readers like
+ * any other, while its members' own cursors leave them. Publishes wake one
+ * waiting member at a time, and a member that leaves messages behind wakes
+ * the next.
+ */
+struct kpub_group {
+	struct kpub_file kf;
+	struct wait_queue_entry wait;
+	wait_queue_head_t wq;
+	size_t nmembers;
+	struct list_head entry;
+	char name[KPUB_NAME_LEN];
+
+	/*
+	 * At-least-once delivery, if the topic had an ack timeout when the
+	 * group was created. The group's cursor then stays at the oldest
+	 * unacked message, holding the slots of those after it, and next is
+	 * the first message not yet delivered. Requeued messages are all at
+	 * or after retry. Under the group cursor's mutex; the lockless wait
+	 * condition reads next, nretry and expired.
+	 */
+	struct kpub_lease *leases;
+	unsigned long timeout;
+	u64 next, retry;
+	size_t nretry;
+	struct timer_list timer;
+	bool expired;
+};
+
+/*
+ * A named position in a topic that outlives its readers, so a reader that
+ * reopens it resumes where the last one committed. The position is a
+ * sequence number and does not hold slots.
+ */
+struct kpub_cursor {
+	struct list_head entry;
+	struct kpub_file *reader;
+	u64 pos;
+	char name[KPUB_NAME_LEN];
+};
+
+/* A message delivered through a group with acks, indexed like its slot. */
+struct kpub_lease {
+	struct kpub_file *owner;
+	unsigned long deadline;
+	bool retry;
+};
+
+/*
+ * A node in the topic name trie, one per '/'-separated segment. A node holds
+ * the topic whose full name ends there, if any, and the subscription patterns
+ * that end there. Pattern wildcards are stored as ordinary children named "+"
+ * and "#", so matching a name only ever follows three children per level.
+ */
+struct trie_node {
+	struct trie_node *parent;
+	struct list_head children, sibling;
+	struct topic *topic;
+	struct list_head patterns;
+	size_t len;
+	char seg[];
+};
+
+/*
+ * A subscription set: one fd reading every topic added to it, directly or
+ * through patterns matching topics created later. Members with messages
+ * waiting are queued on ready by their topic's wakeups, so readiness is a
+ * list check however many topics the set holds.
+ */
+struct kpub_set {
+	/* Serializes reads and membership changes. */
+	struct mutex mtx;
+	struct list_head members, patterns;
+	size_t nmembers;
+	bool merge;
+
+	/* Taken from producers' wakeups, which may run in interrupt context. */
+	spinlock_t lock;
+	struct list_head ready;
+	wait_queue_head_t wq;
+};
+
+/* A topic read through a subscription set. */
+struct kpub_member {
+	struct kpub_set *set;
+	struct kpub_file kf;
+	struct wait_queue_entry wait;
+	struct list_head entry;
+
+	/* On the set's ready list, protected by the set's lock. */
+	struct list_head ready;
+
+	/* Next and end of the messages being merged by a read. */
+	u64 pos, end;
+};
+
+/* A subscription pattern, linked from both its set and its trie node. */
+struct kpub_pattern {
+	struct kpub_set *set;
+	struct trie_node *node;
+	struct list_head node_entry, set_entry;
+};
+
+/*
+ * A writer queued for room on a full topic. Only the writer at the head of
+ * the queue has its turn and is woken when room is made.
+ */
+struct writer_waiter {
+	struct wait_queue_entry wait;
+	struct list_head entry;
+	u64 start;
+	bool turn;
+};
+
+/* A blocked reader waiting for a message its filters accept. */
+struct reader_waiter {
+	struct wait_queue_entry wait;
+	struct kpub_file *kf;
+	u64 scan;
+};
+
+static inline struct kpub_stamp *topic_stamp(struct topic *topic, u64 seq);
+
+/*
+ * Return whether a reader at rp is past the topic's lag limits, either
+ * max_lag messages behind or holding a message older than max_lag_ms.
+ * Called with the topic's lock held.
+ */
+static bool topic_lagging(struct topic *topic, u64 rp, u64 now)
+{
+	size_t max_lag = READ_ONCE(topic->max_lag);
+	u64 max_ns = READ_ONCE(topic->max_lag_ms) * NSEC_PER_MSEC;
+
+	if (rp == topic->wp)
+		return false;
+
+	if (max_lag && topic->wp - rp >= max_lag)
+		return true;
+
+	return max_ns && now - topic_stamp(topic, rp)->ns >= max_ns;
+}
+
+/*
+ * Evict a lagging reader by moving it up to the producer, so its slots can
+ * be reused, and fail its next read with EPIPE. The reader may still be
+ * copying from those slots, so it checks for eviction after copying. Called
+ * with the topic's lock held.
+ */
+static void topic_evict(struct topic *topic, struct kpub_file *kf)
+{
+	if (!kf->lagged)
+		++topic->evicted;
+
+	kf->lag_to = topic->wp;
+	WRITE_ONCE(kf->lagged, true);
+
+	/* Pairs with the barrier in reader_copy. */
+	smp_wmb();
+}
+
+/*
+ * Recompute the slowest reader's cursor, evicting readers past the lag
+ * limits. Called with the topic's lock held, and only when the ring looks
+ * full, which is when a lagging reader holds producers back. With no readers
+ * nothing is retained, so the tail follows wp.
+ */
+static void topic_update_tail(struct topic *topic)
+{
+	bool limited = READ_ONCE(topic->max_lag) || READ_ONCE(topic->max_lag_ms);
+	u64 tail = topic->wp, now = 0, rp;
+	struct kpub_file *kf;
+
+	if (limited)
+		now = ktime_get_mono_fast_ns();
+
+	list_for_each_entry(kf, &topic->readers, entry) {
+		rp = kf->lagged ? kf->lag_to : smp_load_acquire(&kf->rp);
+		if (limited && kf->evictable && topic_lagging(topic, rp, now)) {
+			topic_evict(topic, kf);
+			rp = topic->wp;
+		}
+		tail = min(tail, rp);
+	}
+
+	topic->tail = tail;
+}
+
+/*
+ * Return the number of free slots. Called by producers with the topic's lock
+ * held. The cached tail is only refreshed when it leaves no room.
+ */
+static u64 topic_space(struct topic *topic)
+{
+	if (topic->wp - topic->tail == topic->msg_count)
+		topic_update_tail(topic);
+
+	return topic->msg_count - (topic->wp - topic->tail);
+}
+
+/* Return whether a producer could publish without waiting. */
+static bool topic_writable(struct topic *topic)
+{
+	unsigned long flags;
+	bool writable;
+
+	spin_lock_irqsave(&topic->lock, flags);
+	writable = topic_space(topic) > 0;
+	spin_unlock_irqrestore(&topic->lock, flags);
+
+	return writable;
+}
+
+/* Return the oldest message still in the buffer. Called with the lock held. */
+static inline u64 topic_first(struct topic *topic)
+{
+	return topic->wp - min_t(u64, topic->wp - topic->base,
+				 topic->msg_count);
+}
+
+/* Return the slot holding the message with the given counter. */
+static inline u32 topic_index(struct topic *topic, u64 seq)
+{
+	u32 idx;
+
+	div_u64_rem(seq, topic->msg_count, &idx);
+	return idx;
+}
+
+/* Return the start of a slot, which holds the header if the topic has one. */
+static inline char *topic_hdr(struct topic *topic, u64 seq)
+{
+	return topic->buf + topic_index(topic, seq) * topic->msg_stride;
+}
+
+/* Return the message in a slot, past any header. */
+static inline char *topic_slot(struct topic *topic, u64 seq)
+{
+	return topic_hdr(topic, seq) + topic->hdr_size;
+}
+
+static inline struct kpub_stamp *topic_stamp(struct topic *topic, u64 seq)
+{
+	return &topic->stamps[topic_index(topic, seq)];
+}
+
+static inline struct kpub_key *topic_key(struct topic *topic, u64 seq)
+{
+	return &topic->key_nodes[topic_index(topic, seq)];
+}
+
+/* Return whether a slot holds its key's latest value. */
+static inline bool topic_key_live(struct topic *topic, u64 seq)
+{
+	return !hlist_unhashed_lockless(&topic_key(topic, seq)->node);
+}
+
+/* Return the key of the message in the slot of an index entry. */
+static inline const char *topic_key_of(struct topic *topic,
+				       struct kpub_key *key)
+{
+	return topic->buf + (key - topic->key_nodes) * topic->msg_stride +
+	       topic->hdr_size + topic->key_offset;
+}
+
+/* Return the number of messages published since the reader's cursor. */
+static inline u64 reader_len(struct kpub_file *kf)
+{
+	return smp_load_acquire(&kf->topic->wp) - kf->rp;
+}
+
+/*
+ * Move a reader's cursor forward. The release pairs with topic_update_tail so
+ * a producer never reuses a slot the reader is still copying, and blocked
+ * producers are woken to rescan the readers.
+ */
+static void reader_advance(struct kpub_file *kf, u64 rp)
+{
+	struct topic *topic = kf->topic;
+
+	smp_store_release(&kf->rp, rp);
+
+	if (wq_has_sleeper(&topic->outq))
+		wake_up_interruptible(&topic->outq);
+}
+
+/*
+ * Return whether a message satisfies every predicate. All fields are loaded
+ * and masked in one pass, then each comparison group is folded into a miss
+ * word, so the cost is a few word operations per predicate and no branches
+ * on message contents.
+ */
+static bool preds_match(const struct kpub_preds *preds, const char *msg)
+{
+	u64 x[KPUB_MAX_PREDS], miss = 0;
+	u32 i, n = preds->end[KPUB_PRED_NR_OPS - 1];
+
+	for (i = 0; i < n; ++i) {
+		memcpy(&x[i], msg + preds->off[i], sizeof(x[i]));
+		x[i] &= preds->mask[i];
+	}
+
+	for (i = 0; i < preds->end[KPUB_PRED_EQ]; ++i)
+		miss |= x[i] ^ preds->value[i];
+	for (; i < preds->end[KPUB_PRED_NE]; ++i)
+		miss |= x[i] == preds->value[i];
+	for (; i < preds->end[KPUB_PRED_LT]; ++i)
+		miss |= x[i] >= preds->value[i];
+	for (; i < preds->end[KPUB_PRED_GT]; ++i)
+		miss |= x[i] <= preds->value[i];
+
+	return !miss;
+}
+
+/*
+ * Move a reader's cursor to any retained message or to the tail. Moving back
+ * pulls in the producers' cached tail, so the messages the reader now holds
+ * are not reused underneath it. Called with the reader's mutex held.
+ */
+static int reader_seek(struct kpub_file *kf, u64 seq)
+{
+	struct topic *topic = kf->topic;
+	int err = 0;
+
+	spin_lock_irq(&topic->lock);
+
+	if (seq < topic_first(topic) || seq > topic->wp) {
+		err = -ENXIO;
+	} else {
+		smp_store_release(&kf->rp, seq);
+		topic->tail = min(topic->tail, seq);
+		kf->lagged = false;
+	}
+
+	spin_unlock_irq(&topic->lock);
+
+	/* Moving forward may free slots for blocked producers. */
+	if (!err && wq_has_sleeper(&topic->outq))
+		wake_up_interruptible(&topic->outq);
+
+	return err;
+}
+
+/*
+ * Move a reader's cursor to the first retained message published at or after
+ * ns, or to the tail if there is none, and return its sequence number. Stamps
+ * never decrease along the ring, so this is a binary search over the
+ * retained slots, done under the producer lock so none are reused meanwhile.
+ */
+static u64 reader_seek_time(struct kpub_file *kf, u64 ns)
+{
+	struct topic *topic = kf->topic;
+	u64 lo, hi, mid;
+
+	spin_lock_irq(&topic->lock);
+
+	lo = topic_first(topic);
+	hi = topic->wp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (topic_stamp(topic, mid)->ns < ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	smp_store_release(&kf->rp, lo);
+	topic->tail = min(topic->tail, lo);
+	kf->start = lo;
+	kf->lagged = false;
+
+	spin_unlock_irq(&topic->lock);
+
+	if (wq_has_sleeper(&topic->outq))
+		wake_up_interruptible(&topic->outq);
+
+	return lo;
+}
+
+/*
+ * Return whether a message on a compacted topic should be delivered: it must
+ * be its key's latest value, and if it was carried forward, the reader must
+ * have started after it was first published and so not have seen it yet.
+ */
+static inline bool reader_live(struct kpub_file *kf, u64 seq)
+{
+	struct topic *topic = kf->topic;
+	u64 orig;
+
+	if (!topic->key_len)
+		return true;
+
+	if (!topic_key_live(topic, seq))
+		return false;
+
+	orig = READ_ONCE(topic_key(topic, seq)->orig);
+	return orig == seq || orig < kf->start;
+}
+
+/*
+ * Return whether the reader's predicates and BPF filter accept a message.
+ * Cheap predicates run first so the BPF program only sees what they pass.
+ */
+static bool reader_accept(struct kpub_file *kf, u64 seq)
+{
+	const void *msg = topic_slot(kf->topic, seq);
+	struct kpub_preds *preds;
+	struct bpf_prog *prog;
+	bool accept = true;
+
+	if (!reader_live(kf, seq))
+		return false;
+
+	rcu_read_lock();
+
+	preds = rcu_dereference(kf->preds);
+	if (preds)
+		accept = preds_match(preds, msg);
+
+	prog = rcu_dereference(kf->filter);
+	if (accept && prog)
+		accept = bpf_prog_run_pin_on_cpu(prog, msg);
+
+	rcu_read_unlock();
+
+	return accept;
+}
+
+/*
+ * Return the time to check expiry against, or 0 if no message on the topic
+ * was ever given a TTL, which spares readers the clock.
+ */
+static inline u64 topic_expiry_now(struct topic *topic)
+{
+	return READ_ONCE(topic->ttls) ? ktime_get_mono_fast_ns() : 0;
+}
+
+/* Return whether a message has outlived its TTL. */
+static inline bool topic_expired(struct topic *topic, u64 seq, u64 now)
+{
+	u64 expires = topic_stamp(topic, seq)->expires;
+
+	return now && expires && now >= expires;
+}
+
+/*
+ * Skip expired messages and those the reader's filter rejects, and return
+ * whether an accepted message is waiting. Expired messages are skipped
+ * from their stamps alone, without running filters on them. Called with
+ * the reader's mutex held.
+ */
+static bool reader_pending(struct kpub_file *kf)
+{
+	struct topic *topic = kf->topic;
+	u64 rp = kf->rp, wp = smp_load_acquire(&topic->wp);
+	u64 now = topic_expiry_now(topic), expired = 0;
+
+	for (; rp != wp; ++rp) {
+		if (topic_expired(topic, rp, now))
+			++expired;
+		else if (reader_accept(kf, rp))
+			break;
+	}
+
+	if (expired)
+		atomic_long_add(expired, &topic->expired);
+
+	if (rp != kf->rp)
+		reader_advance(kf, rp);
+
+	return rp != wp;
+}
+
+/*
+ * Look for a message the waiting reader accepts, without moving its cursor.
+ * Called with the topic's inq lock held, both by the reader before it sleeps
+ * and by producers waking it, and remembers how far it got so each message is
+ * filtered once per wait.
+ */
+static bool reader_scan(struct reader_waiter *rw)
+{
+	struct topic *topic = rw->kf->topic;
+	u64 wp = smp_load_acquire(&topic->wp);
+
+	/* An evicted reader wakes to report EPIPE. */
+	if (READ_ONCE(rw->kf->lagged))
+		return true;
+
+	while (rw->scan != wp && !reader_accept(rw->kf, rw->scan))
+		++rw->scan;
+
+	return rw->scan != wp;
+}
+
+/* Wake a blocked reader only if a newly published message is accepted. */
+static int reader_wake(struct wait_queue_entry *wait, unsigned int mode,
+		       int sync, void *key)
+{
+	struct reader_waiter *rw = container_of(wait, struct reader_waiter, wait);
+
+	if (!reader_scan(rw))
+		return 0;
+
+	return autoremove_wake_function(wait, mode, sync, key);
+}
+
+/*
+ * Sleep until a message the reader accepts is published. Producers run the
+ * reader's filters from the wake function, so rejected messages never wake
+ * it. Returns the first message not known to be rejected through scan.
+ * Called without the reader's mutex held.
+ */
+static int reader_wait(struct kpub_file *kf, u64 *scan)
+{
+	struct topic *topic = kf->topic;
+	struct reader_waiter rw = { .kf = kf, .scan = READ_ONCE(kf->rp) };
+	bool ready;
+	int err = 0;
+
+	init_waitqueue_func_entry(&rw.wait, reader_wake);
+	rw.wait.private = current;
+
+	for (;;) {
+		prepare_to_wait(&topic->inq, &rw.wait, TASK_INTERRUPTIBLE);
+
+		spin_lock_irq(&topic->inq.lock);
+		ready = reader_scan(&rw);
+		spin_unlock_irq(&topic->inq.lock);
+
+		if (ready)
+			break;
+		if (signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+
+	finish_wait(&topic->inq, &rw.wait);
+
+	*scan = rw.scan;
+	return err;
+}
+
+/* Stores all topics. */
+LIST_HEAD(topics);
+
+/* Indexes topics and subscription patterns by name. */
+static struct trie_node trie_root = {
+	.children = LIST_HEAD_INIT(trie_root.children),
+	.patterns = LIST_HEAD_INIT(trie_root.patterns),
+};
+
+/* Orders messages across all topics for merged reads. */
+static atomic64_t kpub_seq;
+
+/* Protects topic creation, the trie and subscription patterns. */
+static DEFINE_MUTEX(topic_mtx);
+
+/* Represents the class under sysfs. */
+static struct class kpub_class;
+
+/* Defines file operations for each topic. */
+static struct file_operations kpub_fops;
+
+/* Contains the module's major and minor numbers. */
+static dev_t kpub_devt;
+
+/* Major number assigned by the kernel. */
+static int major_num;
+
+/* Tracks minor numbers in use. */
+static uint8_t minor_nums[NUM_TOPICS];
+
+/* Maps topic ids, which are minor numbers, to topics for BPF publishers. */
+static struct topic __rcu *topic_ids[NUM_TOPICS];
+
+/*
+ * Return whether any file or kernel user, or a message waiting to be
+ * delivered, holds the topic's buffer.
+ */
+static bool topic_busy(struct topic *topic)
+{
+	return topic->nreaders || topic->nwriters || topic->nkernel ||
+	       READ_ONCE(topic->ndelayed);
+}
+
+/*
+ * Start a reader after the newest message or, on latched topics, at it. The
+ * newest message is still in its slot, so latching only moves the cursor
+ * back one and holds the slot like any unread message. Called with the topic
+ * locked.
+ */
+static void topic_add_reader(struct topic *topic, struct kpub_file *kf)
+{
+	++topic->nreaders;
+	spin_lock_irq(&topic->lock);
+	kf->rp = topic->wp;
+	if (topic->latched && topic->wp != topic->base) {
+		--kf->rp;
+		topic->tail = min(topic->tail, kf->rp);
+	}
+	kf->start = kf->rp;
+	list_add_tail(&kf->entry, &topic->readers);
+	spin_unlock_irq(&topic->lock);
+}
+
+/* Stop a reader and let producers reclaim its slots. */
+static void topic_del_reader(struct topic *topic, struct kpub_file *kf)
+{
+	--topic->nreaders;
+	spin_lock_irq(&topic->lock);
+	list_del(&kf->entry);
+	spin_unlock_irq(&topic->lock);
+	wake_up_interruptible(&topic->outq);
+}
+
+/*
+ * Start reading a topic for a subscription set. A topic without a buffer may
+ * still be reconfigured, so the reader watches it instead and joins the
+ * readers once the buffer is allocated. Nothing can be published before
+ * then, so its cursor stays valid. Called with the topic locked.
+ */
+static void topic_watch(struct topic *topic, struct kpub_file *kf)
+{
+	if (topic->buf) {
+		topic_add_reader(topic, kf);
+		return;
+	}
+
+	kf->rp = topic->wp;
+	kf->watching = true;
+	list_add_tail(&kf->entry, &topic->watchers);
+}
+
+/* Stop reading a topic for a subscription set. Called with the topic locked. */
+static void topic_unwatch(struct topic *topic, struct kpub_file *kf)
+{
+	if (kf->watching) {
+		kf->watching = false;
+		list_del(&kf->entry);
+		return;
+	}
+
+	topic_del_reader(topic, kf);
+}
+
+/* Wake one member of a group when its topic publishes. */
+static int group_wake(struct wait_queue_entry *wait, unsigned int mode,
+		      int sync, void *key)
+{
+	struct kpub_group *g = container_of(wait, struct kpub_group, wait);
+
+	wake_up_interruptible(&g->wq);
+
+	return 0;
+}
+
+/* Have a member requeue expired leases once the oldest one times out. */
+static void group_timeout(struct timer_list *t)
+{
+	struct kpub_group *g = container_of(t, struct kpub_group, timer);
+
+	WRITE_ONCE(g->expired, true);
+	wake_up_interruptible(&g->wq);
+}
+
+/*
+ * Find or create a topic's consumer group. Acks name messages by the
+ * sequence numbers in their headers, so a group with acks needs them.
+ * Called with the topic locked.
+ */
+static struct kpub_group *topic_get_group(struct topic *topic,
+					  const char *name)
+{
+	struct kpub_group *g;
+
+	list_for_each_entry(g, &topic->groups, entry) {
+		if (!strcmp(g->name, name))
+			return g;
+	}
+
+	if (topic->ack_timeout_ms && !topic->hdr_size) {
+		dev_err(&topic->dev, "ack_timeout_ms requires msg_header\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	g = kzalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return ERR_PTR(-ENOMEM);
+
+	if (topic->ack_timeout_ms) {
+		g->leases = kcalloc(topic->msg_count, sizeof(*g->leases),
+				    GFP_KERNEL);
+		if (!g->leases) {
+			kfree(g);
+			return ERR_PTR(-ENOMEM);
+		}
+		g->timeout = msecs_to_jiffies(topic->ack_timeout_ms);
+		timer_setup(&g->timer, group_timeout, 0);
+	}
+
+	strscpy(g->name, name, sizeof(g->name));
+	g->kf.topic = topic;
+	g->kf.evictable = !g->leases;
+	mutex_init(&g->kf.mtx);
+	init_waitqueue_head(&g->wq);
+	init_waitqueue_func_entry(&g->wait, group_wake);
+
+	topic_add_reader(topic, &g->kf);
+	g->next = g->kf.rp;
+	add_wait_queue(&topic->inq, &g->wait);
+	list_add_tail(&g->entry, &topic->groups);
+
+	return g;
+}
+
+/*
+ * Drop a reader's group membership, freeing the group with its last member.
+ * Called with the topic locked when the reader's file is released, so no
+ * read can still be using the group.
+ */
+static void topic_leave_group(struct topic *topic, struct kpub_file *kf)
+{
+	struct kpub_group *g = kf->group;
+
+	kf->group = NULL;
+	if (--g->nmembers)
+		return;
+
+	remove_wait_queue(&topic->inq, &g->wait);
+	list_del(&g->entry);
+	topic_del_reader(topic, &g->kf);
+	if (g->leases) {
+		timer_delete_sync(&g->timer);
+		kfree(g->leases);
+	}
+	kfree(g);
+}
+
+/* Return whether a group has messages left, without its mutex. */
+static inline bool group_pending(struct kpub_group *g)
+{
+	u64 wp = smp_load_acquire(&g->kf.topic->wp);
+
+	if (!g->leases)
+		return smp_load_acquire(&g->kf.rp) != wp;
+
+	return READ_ONCE(g->next) != wp || READ_ONCE(g->nretry) ||
+	       READ_ONCE(g->expired);
+}
+
+static inline struct kpub_lease *group_lease(struct kpub_group *g, u64 seq)
+{
+	return &g->leases[topic_index(g->kf.topic, seq)];
+}
+
+/* Queue a leased message for redelivery. Called with the group's mutex held. */
+static void group_requeue(struct kpub_group *g, u64 seq)
+{
+	struct kpub_lease *l = group_lease(g, seq);
+
+	if (!g->nretry || seq < g->retry)
+		g->retry = seq;
+
+	l->owner = NULL;
+	l->retry = true;
+	WRITE_ONCE(g->nretry, g->nretry + 1);
+}
+
+/*
+ * Requeue leases that have timed out and rearm the timer for the oldest one
+ * left. Called with the group's mutex held.
+ */
+static void group_expire(struct kpub_group *g)
+{
+	unsigned long now = jiffies, next = 0;
+	struct kpub_lease *l;
+	bool armed = false;
+	u64 seq;
+
+	WRITE_ONCE(g->expired, false);
+
+	for (seq = g->kf.rp; seq != g->next; ++seq) {
+		l = group_lease(g, seq);
+		if (!l->owner)
+			continue;
+		if (time_after_eq(now, l->deadline)) {
+			group_requeue(g, seq);
+		} else if (!armed || time_before(l->deadline, next)) {
+			next = l->deadline;
+			armed = true;
+		}
+	}
+
+	if (armed)
+		mod_timer(&g->timer, next);
+}
+
+/*
+ * Find the next message to deliver through a group with acks, requeued ones
+ * first. Messages the group does not accept, and expired ones, are passed
+ * over and need no ack. Called with the group's mutex held.
+ */
+static bool group_next(struct kpub_group *g, u64 *seq)
+{
+	struct topic *topic = g->kf.topic;
+	u64 wp = smp_load_acquire(&topic->wp);
+	u64 now = topic_expiry_now(topic), expired = 0;
+	struct kpub_lease *l;
+	bool found = false;
+
+	if (READ_ONCE(g->expired))
+		group_expire(g);
+
+	while (g->nretry && !found) {
+		for (*seq = max(g->retry, g->kf.rp);
+		     !(l = group_lease(g, *seq))->retry; ++*seq)
+			;
+		g->retry = *seq;
+		found = !topic_expired(topic, *seq, now);
+		if (!found) {
+			l->retry = false;
+			WRITE_ONCE(g->nretry, g->nretry - 1);
+			++expired;
+		}
+	}
+
+	if (!found) {
+		for (; g->next != wp; WRITE_ONCE(g->next, g->next + 1)) {
+			if (topic_expired(topic, g->next, now))
+				++expired;
+			else if (reader_accept(&g->kf, g->next))
+				break;
+		}
+		*seq = g->next;
+		found = *seq != wp;
+	}
+
+	if (expired)
+		atomic_long_add(expired, &topic->expired);
+
+	return found;
+}
+
+/* Lease a delivered message to a member until it is acked. */
+static void group_lease_msg(struct kpub_group *g, struct kpub_file *kf,
+			    u64 seq)
+{
+	struct kpub_lease *l = group_lease(g, seq);
+
+	if (l->retry) {
+		l->retry = false;
+		WRITE_ONCE(g->nretry, g->nretry - 1);
+	} else {
+		WRITE_ONCE(g->next, seq + 1);
+	}
+
+	l->owner = kf;
+	l->deadline = jiffies + g->timeout;
+	if (!timer_pending(&g->timer))
+		mod_timer(&g->timer, l->deadline);
+}
+
+/*
+ * Move the group's cursor past acked and skipped messages, releasing their
+ * slots. Called with the group's mutex held.
+ */
+static void group_settle(struct kpub_group *g)
+{
+	struct kpub_lease *l;
+	u64 rp;
+
+	for (rp = g->kf.rp; rp != g->next; ++rp) {
+		l = group_lease(g, rp);
+		if (l->owner || l->retry)
+			break;
+	}
+
+	if (rp != g->kf.rp)
+		reader_advance(&g->kf, rp);
+}
+
+/* Return whether a group has a message to deliver. Called with its mutex held. */
+static bool group_ready(struct kpub_group *g)
+{
+	u64 seq;
+
+	if (!g->leases)
+		return reader_pending(&g->kf);
+
+	if (group_next(g, &seq))
+		return true;
+
+	group_settle(g);
+	return false;
+}
+
+/*
+ * Copy up to max messages through a group with acks, leasing each to the
+ * member until it acks it. Called with the group's mutex held.
+ */
+static ssize_t group_copy(struct kpub_group *g, struct kpub_file *kf,
+			  char __user *buf, size_t max, size_t rec,
+			  size_t hdr_size)
+{
+	struct topic *topic = g->kf.topic;
+	size_t n = 0;
+	int err = 0;
+	u64 seq;
+
+	while (n < max && group_next(g, &seq)) {
+		if (copy_to_user(buf + n * rec, topic_slot(topic, seq) - hdr_size,
+				 rec)) {
+			err = -EFAULT;
+			break;
+		}
+		group_lease_msg(g, kf, seq);
+		++n;
+	}
+
+	group_settle(g);
+
+	return n ? n * rec : err;
+}
+
+/*
+ * Acknowledge messages read through a group with acks. Called with the
+ * group's mutex held.
+ */
+static int group_ack(struct kpub_group *g, struct kpub_file *kf,
+		     const u64 *seqs, size_t n)
+{
+	struct kpub_lease *l;
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		if (seqs[i] >= g->next)
+			return -EINVAL;
+		if (seqs[i] < g->kf.rp)
+			continue;
+
+		l = group_lease(g, seqs[i]);
+		if (l->retry) {
+			l->retry = false;
+			WRITE_ONCE(g->nretry, g->nretry - 1);
+		} else if (l->owner != kf) {
+			continue;
+		}
+		l->owner = NULL;
+	}
+
+	return 0;
+}
+
+/* Requeue the messages a member still holds when its file is released. */
+static void group_drop_member(struct kpub_group *g, struct kpub_file *kf)
+{
+	u64 seq;
+
+	mutex_lock(&g->kf.mtx);
+
+	for (seq = g->kf.rp; seq != g->next; ++seq) {
+		if (group_lease(g, seq)->owner == kf)
+			group_requeue(g, seq);
+	}
+
+	if (g->nretry)
+		wake_up_interruptible(&g->wq);
+
+	mutex_unlock(&g->kf.mtx);
+}
+
+/* Return the slot stride for messages and headers of a given size. */
+static inline size_t topic_stride(size_t size, bool pad)
+{
+	return pad ? L1_CACHE_ALIGN(size) : size;
+}
+
+/*
+ * Check that the buffer for a new geometry can be allocated, counting slot
+ * headers and padding as well as the messages themselves.
+ */
+static int topic_check_geometry(struct topic *topic, size_t size,
+				size_t count, size_t hdr_size, bool pad)
+{
+	size_t total;
+
+	if (check_mul_overflow(topic_stride(size + hdr_size, pad), count,
+			       &total) ||
+	    total > KMALLOC_MAX_SIZE) {
+		dev_err(&topic->dev,
+			"%lu slots of %lu bytes exceed the maximum buffer size\n",
+			count, topic_stride(size + hdr_size, pad));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate a snapshot topic's versions if needed. They can be large, so they
+ * may be vmalloc'ed. Called with the topic locked.
+ */
+static int topic_alloc_snaps(struct topic *topic)
+{
+	size_t total;
+	int i;
+
+	if (topic->msg_size == 0) {
+		dev_err(&topic->dev, "set msg_size before opening\n");
+		return -ENOMEM;
+	}
+
+	/* msg_count does not apply, so topic_check_geometry did not bound this. */
+	if (check_mul_overflow(topic->msg_size, (size_t)NUM_SNAPS, &total) ||
+	    total > INT_MAX) {
+		dev_err(&topic->dev,
+			"%d snapshots of %zu bytes exceed the maximum buffer size\n",
+			NUM_SNAPS, topic->msg_size);
+		return -EINVAL;
+	}
+
+	if (topic->snap_buf)
+		return 0;
+
+	topic->snap_buf = kvzalloc(total, GFP_KERNEL);
+	if (!topic->snap_buf)
+		return -ENOMEM;
+
+	for (i = 0; i < NUM_SNAPS; ++i) {
+		topic->snaps[i].data = topic->snap_buf + i * topic->msg_size;
+		topic->snaps[i].gen = 0;
+	}
+
+	topic->snap_latest = 0;
+	topic->snap_gen = 0;
+
+	return 0;
+}
+
+static int topic_alloc_buf(struct topic *topic);
+
+/*
+ * Allocate the buffers of a partitioned topic's partitions. Partitions are
+ * locked inside their parent. Called with the topic locked.
+ */
+static int topic_alloc_parts(struct topic *topic)
+{
+	struct topic *part;
+	size_t i;
+	int err;
+
+	if (topic->msg_size == 0 || topic->msg_count == 0) {
+		dev_err(&topic->dev,
+			"set msg_size and msg_count before opening\n");
+		return -ENOMEM;
+	}
+
+	if (topic->key_len > topic->msg_size ||
+	    topic->key_offset > topic->msg_size - topic->key_len) {
+		dev_err(&topic->dev, "key must lie within the message\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < topic->nparts; ++i) {
+		part = topic->parts[i];
+		mutex_lock_nested(&part->mtx, SINGLE_DEPTH_NESTING);
+		err = topic_alloc_buf(part);
+		mutex_unlock(&part->mtx);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Count a partitioned topic's writer or kernel publisher against each of its
+ * partitions too, so they cannot be reconfigured under it. Called with the
+ * topic locked.
+ */
+static void topic_hold_parts(struct topic *topic, int delta)
+{
+	struct topic *part;
+	size_t i;
+
+	for (i = 0; i < topic->nparts; ++i) {
+		part = topic->parts[i];
+		mutex_lock_nested(&part->mtx, SINGLE_DEPTH_NESTING);
+		part->nwriters += delta;
+		mutex_unlock(&part->mtx);
+	}
+}
+
+/*
+ * Start a reader on a topic with lanes, with a cursor in each lane. Called
+ * with the topic locked and the lanes' buffers allocated.
+ */
+static int topic_add_lane_reader(struct topic *topic, struct kpub_file *kf)
+{
+	struct kpub_file *lane;
+	size_t i;
+
+	kf->lanes = kcalloc(topic->nparts, sizeof(*kf->lanes), GFP_KERNEL);
+	if (!kf->lanes)
+		return -ENOMEM;
+
+	for (i = 0; i < topic->nparts; ++i) {
+		lane = &kf->lanes[i];
+		lane->topic = topic->parts[i];
+		lane->evictable = true;
+		mutex_init(&lane->mtx);
+		mutex_lock_nested(&lane->topic->mtx, SINGLE_DEPTH_NESTING);
+		topic_add_reader(lane->topic, lane);
+		mutex_unlock(&lane->topic->mtx);
+	}
+
+	++topic->nreaders;
+
+	return 0;
+}
+
+/* Stop a reader of a topic with lanes. Called with the topic locked. */
+static void topic_del_lane_reader(struct topic *topic, struct kpub_file *kf)
+{
+	struct kpub_file *lane;
+	size_t i;
+
+	for (i = 0; i < topic->nparts; ++i) {
+		lane = &kf->lanes[i];
+		mutex_lock_nested(&lane->topic->mtx, SINGLE_DEPTH_NESTING);
+		topic_del_reader(lane->topic, lane);
+		mutex_unlock(&lane->topic->mtx);
+	}
+
+	--topic->nreaders;
+	kfree(kf->lanes);
+}
+
+/* Allocate the topic's buffer if needed. Called with the topic locked. */
+static int topic_alloc_buf(struct topic *topic)
+{
+	struct kpub_key *key_nodes = NULL;
+	struct hlist_head *keys = NULL;
+	struct kpub_stamp *stamps;
+	struct kpub_file *kf, *tmp;
+	unsigned int key_bits = 0;
+	char *buf;
+
+	if (topic->nparts)
+		return topic_alloc_parts(topic);
+
+	if (topic->snapshot)
+		return topic_alloc_snaps(topic);
+
+	if (topic->msg_size == 0 || topic->msg_count == 0) {
+		dev_err(&topic->dev,
+			"set msg_size and msg_count before opening\n");
+		return -ENOMEM;
+	}
+
+	if (topic->buf)
+		return 0;
+
+	if (topic->key_len > topic->msg_size ||
+	    topic->key_offset > topic->msg_size - topic->key_len) {
+		dev_err(&topic->dev, "key must lie within the message\n");
+		return -EINVAL;
+	}
+
+	topic->msg_stride = topic_stride(topic->msg_size + topic->hdr_size,
+					 topic->pad_slots);
+	buf = (char *)kzalloc(topic->msg_stride * topic->msg_count, GFP_KERNEL);
+	stamps = kcalloc(topic->msg_count, sizeof(*stamps), GFP_KERNEL);
+	if (!buf || !stamps)
+		goto cleanup;
+
+	if (topic->key_len) {
+		key_bits = ilog2(roundup_pow_of_two(topic->msg_count));
+		keys = kcalloc(1UL << key_bits, sizeof(*keys), GFP_KERNEL);
+		key_nodes = kcalloc(topic->msg_count, sizeof(*key_nodes),
+				    GFP_KERNEL);
+		if (!keys || !key_nodes)
+			goto cleanup;
+	}
+
+	/* BPF producers check buf under the lock and then use the rest. */
+	spin_lock_irq(&topic->lock);
+	topic->buf = buf;
+	topic->stamps = stamps;
+	topic->keys = keys;
+	topic->key_nodes = key_nodes;
+	topic->key_bits = key_bits;
+	topic->nlive = 0;
+	topic->base = topic->wp;
+	spin_unlock_irq(&topic->lock);
+
+	list_for_each_entry_safe(kf, tmp, &topic->watchers, entry) {
+		list_del(&kf->entry);
+		kf->watching = false;
+		topic_add_reader(topic, kf);
+	}
+
+	return 0;
+
+cleanup:
+	kfree(buf);
+	kfree(stamps);
+	kfree(keys);
+	kfree(key_nodes);
+	return -ENOMEM;
+}
+
+/*
+ * Free the topic's buffer so it is reallocated with new geometry on the next
+ * open. BPF programs publish by topic id without holding a reference, so the
+ * buffer is detached under the producer lock before it is freed.
+ */
+static void topic_free_buf(struct topic *topic)
+{
+	struct kpub_key *key_nodes;
+	struct kpub_stamp *stamps;
+	struct hlist_head *keys;
+	char *buf;
+
+	spin_lock_irq(&topic->lock);
+	buf = topic->buf;
+	stamps = topic->stamps;
+	keys = topic->keys;
+	key_nodes = topic->key_nodes;
+	topic->buf = NULL;
+	topic->stamps = NULL;
+	topic->keys = NULL;
+	topic->key_nodes = NULL;
+	spin_unlock_irq(&topic->lock);
+
+	kfree(buf);
+	kfree(stamps);
+	kfree(keys);
+	kfree(key_nodes);
+
+	kvfree(topic->snap_buf);
+	topic->snap_buf = NULL;
+}
+
+/* Read the topic name. */
+static ssize_t name_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	size_t len = strlen(topic->name);
+	memcpy(buf, topic->name, len);
+	return len;
+}
+
+/* Read the topic message size. */
+static ssize_t msg_size_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->msg_size);
+}
+
+/* Store the topic message size. */
+static ssize_t msg_size_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned long val;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtoul(buf, 10, &val);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	err = topic_check_geometry(topic, val, topic->msg_count,
+				   topic->hdr_size, topic->pad_slots);
+	if (err) {
+		len = err;
+		goto cleanup;
+	}
+
+	topic_free_buf(topic);
+	topic->msg_size = val;
+
+	dev_info(&topic->dev, "message size set to %lu bytes\n",
+		 topic->msg_size);
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+/* Read the topic message count. */
+static ssize_t msg_count_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->msg_count);
+}
+
+/* Store the topic message count. */
+static ssize_t msg_count_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned long val;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtoul(buf, 10, &val);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	if (val > U32_MAX) {
+		dev_err(&topic->dev, "message count cannot exceed %u\n",
+			U32_MAX);
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = topic_check_geometry(topic, topic->msg_size, val,
+				   topic->hdr_size, topic->pad_slots);
+	if (err) {
+		len = err;
+		goto cleanup;
+	}
+
+	topic_free_buf(topic);
+	topic->msg_count = val;
+
+	dev_info(&topic->dev, "message count set to %lu\n", topic->msg_count);
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+/* Read whether message slots are padded to a cache line. */
+static ssize_t pad_slots_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%d", topic->pad_slots);
+}
+
+/*
+ * Store whether message slots are padded to a cache line. Padding keeps a
+ * reader copying one message from sharing a line with the writer filling the
+ * next, at the cost of buffer space for small messages.
+ */
+static ssize_t pad_slots_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	bool pad;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtobool(buf, &pad);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	err = topic_check_geometry(topic, topic->msg_size, topic->msg_count,
+				   topic->hdr_size, pad);
+	if (err) {
+		len = err;
+		goto cleanup;
+	}
+
+	topic_free_buf(topic);
+	topic->pad_slots = pad;
+
+	dev_info(&topic->dev, "slot padding %s\n",
+		 topic->pad_slots ? "enabled" : "disabled");
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+/* Read whether slots start with a struct kpub_hdr. */
+static ssize_t msg_header_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%d", topic->hdr_size != 0);
+}
+
+/*
+ * Store whether slots start with a struct kpub_hdr filled in on publish.
+ * Readers only see it if they ask for it with KPUB_IOC_READ_HEADER.
+ */
+static ssize_t msg_header_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	size_t hdr_size;
+	bool header;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtobool(buf, &header);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	hdr_size = header ? sizeof(struct kpub_hdr) : 0;
+
+	err = topic_check_geometry(topic, topic->msg_size, topic->msg_count,
+				   hdr_size, topic->pad_slots);
+	if (err) {
+		len = err;
+		goto cleanup;
+	}
+
+	topic_free_buf(topic);
+	topic->hdr_size = hdr_size;
+
+	dev_info(&topic->dev, "message headers %s\n",
+		 header ? "enabled" : "disabled");
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+static struct topic *create_topic(const char *name);
+static void delete_topic(struct topic *topic);
+static void trie_match_patterns(struct trie_node *node, const char *name,
+				struct topic *topic);
+
+/* Read the number of partitions, or 0 if the topic is not partitioned. */
+static ssize_t partitions_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->lanes ? 0 : topic->nparts);
+}
+
+/*
+ * Detach a topic's partitions and delete them. BPF publishers pick a
+ * partition under the producer lock without holding a reference, so the
+ * array is detached under the lock and only freed once deleting the
+ * partitions has waited for RCU readers. Called with topic_mtx held.
+ */
+static void topic_drop_parts(struct topic *topic)
+{
+	struct topic **parts;
+	size_t i, nparts;
+
+	spin_lock_irq(&topic->lock);
+	parts = topic->parts;
+	nparts = topic->nparts;
+	topic->parts = NULL;
+	topic->nparts = 0;
+	spin_unlock_irq(&topic->lock);
+
+	for (i = 0; i < nparts; ++i)
+		delete_topic(parts[i]);
+	kfree(parts);
+}
+
+/* Delete a topic's partitions unless one is open. Called with topic_mtx held. */
+static int topic_del_parts(struct topic *topic)
+{
+	struct topic *part;
+	bool busy;
+	size_t i;
+
+	for (i = 0; i < topic->nparts; ++i) {
+		part = topic->parts[i];
+		mutex_lock(&part->mtx);
+		busy = topic_busy(part);
+		mutex_unlock(&part->mtx);
+		if (busy) {
+			dev_err(&part->dev, "partition is open\n");
+			return -EBUSY;
+		}
+	}
+
+	topic_drop_parts(topic);
+
+	return 0;
+}
+
+/* Create a partition configured like its topic. Called with topic_mtx held. */
+static struct topic *topic_add_part(struct topic *topic, size_t i)
+{
+	char name[MAX_STR_LEN];
+	struct topic *part;
+
+	if (snprintf(name, sizeof(name), "%s/%lu", topic->name, i) >=
+	    sizeof(name))
+		return ERR_PTR(-ENAMETOOLONG);
+
+	part = create_topic(name);
+	if (IS_ERR(part))
+		return part;
+
+	mutex_lock(&part->mtx);
+	part->parent = topic;
+	part->msg_size = topic->msg_size;
+	part->msg_count = topic->msg_count;
+	part->hdr_size = topic->hdr_size;
+	part->pad_slots = topic->pad_slots;
+	part->latched = topic->latched;
+	part->ttl_us = topic->ttl_us;
+	mutex_unlock(&part->mtx);
+
+	return part;
+}
+
+/* Split the topic into partitions or lanes, or merge it back with 0. */
+static ssize_t topic_store_parts(struct device *dev, const char *buf,
+				 size_t len, bool lanes)
+{
+	struct topic *topic = dev_to_topic(dev);
+	struct topic **parts = NULL;
+	unsigned long val, i = 0;
+	bool busy;
+	int err;
+
+	err = kstrtoul(buf, 10, &val);
+	if (err < 0)
+		return err;
+
+	if (val >= NUM_TOPICS)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&topic_mtx))
+		return -ERESTARTSYS;
+
+	if (topic->parent || topic->snapshot) {
+		dev_err(&topic->dev,
+			"partitions, lanes and snapshot topics cannot be split\n");
+		err = -EINVAL;
+		goto cleanup;
+	}
+
+	mutex_lock(&topic->mtx);
+	busy = topic_busy(topic);
+	mutex_unlock(&topic->mtx);
+
+	if (busy) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		err = -EINVAL;
+		goto cleanup;
+	}
+
+	err = topic_del_parts(topic);
+	if (err)
+		goto cleanup;
+
+	if (val) {
+		parts = kcalloc(val, sizeof(*parts), GFP_KERNEL);
+		if (!parts) {
+			err = -ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < val; ++i) {
+		parts[i] = topic_add_part(topic, i);
+		if (IS_ERR(parts[i])) {
+			err = PTR_ERR(parts[i]);
+			goto cleanup_parts;
+		}
+	}
+
+	/*
+	 * The topic may have been opened or made a snapshot topic while
+	 * partitions were created.
+	 */
+	mutex_lock(&topic->mtx);
+	if (topic_busy(topic) || topic->snapshot) {
+		mutex_unlock(&topic->mtx);
+		err = -EINVAL;
+		goto cleanup_parts;
+	}
+	topic_free_buf(topic);
+	spin_lock_irq(&topic->lock);
+	topic->parts = parts;
+	topic->nparts = val;
+	topic->lanes = lanes && val;
+	spin_unlock_irq(&topic->lock);
+	mutex_unlock(&topic->mtx);
+
+	dev_info(&topic->dev, "%s set to %lu\n", lanes ? "lanes" : "partitions",
+		 val);
+
+	/* Sets subscribed by patterns matching the topic read its partitions. */
+	trie_match_patterns(&trie_root, topic->name, topic);
+
+	mutex_unlock(&topic_mtx);
+
+	return len;
+
+cleanup_parts:
+	while (i--)
+		delete_topic(parts[i]);
+	kfree(parts);
+cleanup:
+	mutex_unlock(&topic_mtx);
+
+	return err;
+}
+
+/*
+ * Split the topic into partitions, or merge it back with 0. Each partition
+ * is a topic named <name>/<n> with its own ring and lock, configured like
+ * this topic when it is created; it can be tuned on its own afterwards but
+ * must keep msg_size. Writes to this topic are routed by the key set with
+ * key_offset and key_len, or spread round-robin without one. Readers open a
+ * partition, or subscribe a set to <name>/+ to read them all.
+ */
+static ssize_t partitions_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	return topic_store_parts(dev, buf, len, false);
+}
+
+/* Read the number of priority lanes, or 0 if the topic has none. */
+static ssize_t lanes_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->lanes ? topic->nparts : 0);
+}
+
+/*
+ * Split the topic into priority lanes, or merge it back with 0. Lanes are
+ * topics named <name>/<n> like partitions, so each has its own capacity,
+ * counters and limits. Writers pick a lane with KPUB_IOC_SET_LANE, and
+ * readers of this topic drain higher lanes first, so urgent messages never
+ * queue behind bulk ones.
+ */
+static ssize_t lanes_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	return topic_store_parts(dev, buf, len, true);
+}
+
+/* Read whether the topic holds snapshots rather than a message ring. */
+static ssize_t snapshot_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%d", topic->snapshot);
+}
+
+/*
+ * Store whether the topic holds snapshots: each write replaces the state,
+ * msg_size bytes at a time, and reads return the latest state once per
+ * generation. msg_count and the ring attributes do not apply.
+ */
+static ssize_t snapshot_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	bool snapshot;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic->parent || topic->nparts) {
+		dev_err(&topic->dev,
+			"snapshots cannot be combined with partitions or lanes\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtobool(buf, &snapshot);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	topic_free_buf(topic);
+	topic->snapshot = snapshot;
+
+	dev_info(&topic->dev, "snapshots %s\n",
+		 snapshot ? "enabled" : "disabled");
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+/* Read where the compaction key starts in each message. */
+static ssize_t key_offset_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->key_offset);
+}
+
+/* Read the length of the compaction key, or 0 if the topic is not compacted. */
+static ssize_t key_len_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", topic->key_len);
+}
+
+/*
+ * Store the compaction key's offset or length. A topic with a key keeps only
+ * the latest message for each key: superseded messages are skipped by
+ * readers and their slots reused first, so a reader that seeks to the oldest
+ * retained message reads the current value of every key. The key must lie
+ * within the message, which is checked when the buffer is allocated.
+ */
+static ssize_t key_store(struct device *dev, const char *buf, size_t len,
+			 bool offset)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned long val;
+	int err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (topic_busy(topic)) {
+		dev_err(&topic->dev,
+			"cannot modify buffers with open file descriptors\n");
+		len = -EINVAL;
+		goto cleanup;
+	}
+
+	err = kstrtoul(buf, 10, &val);
+	if (err < 0) {
+		len = err;
+		goto cleanup;
+	}
+
+	/* BPF publishers route by the key under the producer lock. */
+	topic_free_buf(topic);
+	spin_lock_irq(&topic->lock);
+	if (offset)
+		topic->key_offset = val;
+	else
+		topic->key_len = val;
+	spin_unlock_irq(&topic->lock);
+
+	dev_info(&topic->dev, "compaction key set to %lu bytes at offset %lu\n",
+		 topic->key_len, topic->key_offset);
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+	return len;
+}
+
+static ssize_t key_offset_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	return key_store(dev, buf, len, true);
+}
+
+static ssize_t key_len_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t len)
+{
+	return key_store(dev, buf, len, false);
+}
+
+/* Read whether new readers start at the newest message. */
+static ssize_t latched_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%d", topic->latched);
+}
+
+/*
+ * Store whether new readers start at the newest message, for topics that
+ * carry state a subscriber needs before the next publish. Only affects
+ * readers opened afterwards.
+ */
+static ssize_t latched_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	bool latched;
+	int err;
+
+	err = kstrtobool(buf, &latched);
+	if (err < 0)
+		return err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+	topic->latched = latched;
+	mutex_unlock(&topic->mtx);
+
+	return len;
+}
+
+/* Read how long group readers have to ack a message, or 0 if they need not. */
+static ssize_t ack_timeout_ms_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%u", topic->ack_timeout_ms);
+}
+
+/*
+ * Store how long group readers have to ack a message before it is
+ * redelivered to another member, turning on at-least-once delivery for
+ * consumer groups. Readers ack by header sequence number, so msg_header
+ * must be set. Only affects groups created afterwards.
+ */
+static ssize_t ack_timeout_ms_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned int ms;
+	int err;
+
+	err = kstrtouint(buf, 10, &ms);
+	if (err < 0)
+		return err;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	if (ms && !topic->hdr_size) {
+		dev_err(&topic->dev, "ack_timeout_ms requires msg_header\n");
+		len = -EINVAL;
+	} else {
+		topic->ack_timeout_ms = ms;
+	}
+
+	mutex_unlock(&topic->mtx);
+
+	return len;
+}
+
+/* Find a topic's durable cursor by name. Called with the topic locked. */
+static struct kpub_cursor *topic_find_cursor(struct topic *topic,
+					     const char *name)
+{
+	struct kpub_cursor *c;
+
+	list_for_each_entry(c, &topic->cursors, entry) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * List the topic's durable cursors, one per line, as the name, the committed
+ * position, how many messages have been published since and whether a
+ * reader is attached.
+ */
+static ssize_t cursors_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	struct kpub_cursor *c;
+	size_t n = 0;
+	u64 pos;
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	list_for_each_entry(c, &topic->cursors, entry) {
+		pos = READ_ONCE(c->pos);
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%s %llu %llu %d\n",
+			       c->name, pos, READ_ONCE(topic->wp) - pos,
+			       c->reader != NULL);
+	}
+
+	mutex_unlock(&topic->mtx);
+
+	return n;
+}
+
+/* Delete a durable cursor by writing its name. */
+static ssize_t remove_cursor_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	char name[KPUB_NAME_LEN] = { 0 };
+	size_t name_len = len;
+	struct kpub_cursor *c;
+	int err = 0;
+
+	if (name_len && buf[name_len - 1] == '\n')
+		--name_len;
+
+	if (name_len == 0 || name_len >= KPUB_NAME_LEN)
+		return -EINVAL;
+
+	memcpy(name, buf, name_len);
+
+	if (mutex_lock_interruptible(&topic->mtx))
+		return -ERESTARTSYS;
+
+	c = topic_find_cursor(topic, name);
+	if (!c) {
+		err = -ENOENT;
+	} else if (c->reader) {
+		dev_err(&topic->dev, "cursor '%s' has a reader\n", name);
+		err = -EBUSY;
+	} else {
+		list_del(&c->entry);
+		--topic->ncursors;
+		kfree(c);
+	}
+
+	mutex_unlock(&topic->mtx);
+
+	return err ? err : len;
+}
+
+/* Read the lag limit in messages, or 0 if there is none. */
+static ssize_t max_lag_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", READ_ONCE(topic->max_lag));
+}
+
+/*
+ * Store the lag limit in messages. When the ring fills, readers this far
+ * behind are evicted rather than blocking producers: they skip to the newest
+ * message and their next read fails with EPIPE. Group readers with acks and
+ * subscription sets are never evicted.
+ */
+static ssize_t max_lag_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned long val;
+	int err;
+
+	err = kstrtoul(buf, 10, &val);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(topic->max_lag, val);
+
+	return len;
+}
+
+/* Read the lag limit in milliseconds, or 0 if there is none. */
+static ssize_t max_lag_ms_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%u", READ_ONCE(topic->max_lag_ms));
+}
+
+/*
+ * Store the lag limit in milliseconds. Like max_lag, but evicts readers
+ * whose oldest unread message was published this long ago.
+ */
+static ssize_t max_lag_ms_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(topic->max_lag_ms, val);
+
+	return len;
+}
+
+/* Read the topic's shared message rate limit per second, or 0 for none. */
+static ssize_t rate_msgs_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%llu",
+			READ_ONCE(topic->limits.msgs.rate));
+}
+
+static ssize_t rate_store(struct kpub_limit *l, const char *buf, size_t len)
+{
+	u64 rate;
+	int err;
+
+	err = kstrtou64(buf, 10, &rate);
+	if (err < 0)
+		return err;
+
+	WRITE_ONCE(l->rate, min_t(u64, rate, MAX_RATE));
+
+	return len;
+}
+
+/*
+ * Store the message rate limit shared by all the topic's writers, on top of
+ * any each sets with KPUB_IOC_SET_RATE.
+ */
+static ssize_t rate_msgs_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return rate_store(&topic->limits.msgs, buf, len);
+}
+
+/* Read the topic's shared byte rate limit per second, or 0 for none. */
+static ssize_t rate_bytes_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%llu",
+			READ_ONCE(topic->limits.bytes.rate));
+}
+
+/* Store the byte rate limit shared by all the topic's writers. */
+static ssize_t rate_bytes_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return rate_store(&topic->limits.bytes, buf, len);
+}
+
+/* Read what happens to writes over the shared limits, delay or reject. */
+static ssize_t rate_policy_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%s",
+			READ_ONCE(topic->limits.reject) ? "reject" : "delay");
+}
+
+/*
+ * Store whether writes over the shared limits sleep until they are allowed,
+ * with "delay", or fail with EAGAIN, with "reject".
+ */
+static ssize_t rate_policy_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+
+	if (sysfs_streq(buf, "delay"))
+		WRITE_ONCE(topic->limits.reject, false);
+	else if (sysfs_streq(buf, "reject"))
+		WRITE_ONCE(topic->limits.reject, true);
+	else
+		return -EINVAL;
+
+	return len;
+}
+
+/* Read the number of writes delayed or rejected by a rate limit. */
+static ssize_t throttled_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%ld",
+			atomic_long_read(&topic->throttled));
+}
+
+/*
+ * Read how long writers waited for room, one line per bucket with the upper
+ * bound in microseconds and the count. Bounds double from 1us; the last
+ * bucket is unbounded.
+ */
+static ssize_t write_wait_us_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < NUM_WAIT_BUCKETS - 1; ++i)
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%llu %ld\n", 1ULL << i,
+			       atomic_long_read(&topic->wait_hist[i]));
+	n += scnprintf(buf + n, PAGE_SIZE - n, "inf %ld\n",
+		       atomic_long_read(&topic->wait_hist[i]));
+
+	return n;
+}
+
+/* Read the default time to live of messages, or 0 if they do not expire. */
+static ssize_t ttl_us_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%llu", READ_ONCE(topic->ttl_us));
+}
+
+/*
+ * Store the default time to live of messages published from now on. Readers
+ * skip messages older than this without copying them. Writers can override
+ * it with KPUB_IOC_SET_TTL.
+ */
+static ssize_t ttl_us_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t len)
+{
+	struct topic *topic = dev_to_topic(dev);
+	u64 us;
+	int err;
+
+	err = kstrtou64(buf, 10, &us);
+	if (err < 0)
+		return err;
+
+	if (us > U64_MAX / NSEC_PER_USEC)
+		return -EINVAL;
+
+	WRITE_ONCE(topic->ttl_us, us);
+
+	return len;
+}
+
+/* Read the number of messages waiting to be delivered. */
+static ssize_t delayed_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%zu", READ_ONCE(topic->ndelayed));
+}
+
+/* Read the number of expired messages readers skipped. */
+static ssize_t expired_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%ld",
+			atomic_long_read(&topic->expired));
+}
+
+/* Read the number of times a reader was evicted for lagging. */
+static ssize_t evicted_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", READ_ONCE(topic->evicted));
+}
+
+/* Read the topic id used to publish from BPF programs. */
+static ssize_t id_show(struct device *dev, struct device_attribute *attr,
+		       char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%d", topic->dev.id);
+}
+
+/* Read the number of messages dropped by non-blocking kernel publishers. */
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct topic *topic = dev_to_topic(dev);
+	return snprintf(buf, MAX_STR_LEN, "%lu", READ_ONCE(topic->dropped));
+}
+
+DEVICE_ATTR_RO(name);
+DEVICE_ATTR_RO(id);
+DEVICE_ATTR_RO(dropped);
+DEVICE_ATTR_RO(evicted);
+DEVICE_ATTR_RO(throttled);
+DEVICE_ATTR_RO(expired);
+DEVICE_ATTR_RO(delayed);
+DEVICE_ATTR(ttl_us, 0644, ttl_us_show, ttl_us_store);
+DEVICE_ATTR_RO(write_wait_us);
+DEVICE_ATTR(rate_msgs, 0644, rate_msgs_show, rate_msgs_store);
+DEVICE_ATTR(rate_bytes, 0644, rate_bytes_show, rate_bytes_store);
+DEVICE_ATTR(rate_policy, 0644, rate_policy_show, rate_policy_store);
+DEVICE_ATTR(max_lag, 0644, max_lag_show, max_lag_store);
+DEVICE_ATTR(max_lag_ms, 0644, max_lag_ms_show, max_lag_ms_store);
+DEVICE_ATTR_RO(cursors);
+DEVICE_ATTR_WO(remove_cursor);
+DEVICE_ATTR(msg_size, 0644, msg_size_show, msg_size_store);
+DEVICE_ATTR(msg_count, 0644, msg_count_show, msg_count_store);
+DEVICE_ATTR(pad_slots, 0644, pad_slots_show, pad_slots_store);
+DEVICE_ATTR(msg_header, 0644, msg_header_show, msg_header_store);
+DEVICE_ATTR(latched, 0644, latched_show, latched_store);
+DEVICE_ATTR(ack_timeout_ms, 0644, ack_timeout_ms_show, ack_timeout_ms_store);
+DEVICE_ATTR(snapshot, 0644, snapshot_show, snapshot_store);
+DEVICE_ATTR(partitions, 0644, partitions_show, partitions_store);
+DEVICE_ATTR(lanes, 0644, lanes_show, lanes_store);
+DEVICE_ATTR(key_offset, 0644, key_offset_show, key_offset_store);
+DEVICE_ATTR(key_len, 0644, key_len_show, key_len_store);
+static struct attribute *topic_attrs[] = {
+	&dev_attr_name.attr,
+	&dev_attr_id.attr,
+	&dev_attr_msg_size.attr,
+	&dev_attr_msg_count.attr,
+	&dev_attr_pad_slots.attr,
+	&dev_attr_msg_header.attr,
+	&dev_attr_latched.attr,
+	&dev_attr_ack_timeout_ms.attr,
+	&dev_attr_snapshot.attr,
+	&dev_attr_partitions.attr,
+	&dev_attr_lanes.attr,
+	&dev_attr_key_offset.attr,
+	&dev_attr_key_len.attr,
+	&dev_attr_dropped.attr,
+	&dev_attr_max_lag.attr,
+	&dev_attr_max_lag_ms.attr,
+	&dev_attr_evicted.attr,
+	&dev_attr_rate_msgs.attr,
+	&dev_attr_rate_bytes.attr,
+	&dev_attr_rate_policy.attr,
+	&dev_attr_throttled.attr,
+	&dev_attr_ttl_us.attr,
+	&dev_attr_expired.attr,
+	&dev_attr_delayed.attr,
+	&dev_attr_write_wait_us.attr,
+	&dev_attr_cursors.attr,
+	&dev_attr_remove_cursor.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(topic);
+
+/* Reserve and return the first available minor number. */
+static int reserve_minor_num(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_TOPICS; ++i) {
+		if (!minor_nums[i]) {
+			minor_nums[i] = 1;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Mark the given minor number as available. */
+static void release_minor_num(int minor_num)
+{
+	minor_nums[minor_num] = 0;
+}
+
+/* Free a topic once its device and every open file have let go of it. */
+static void device_release(struct device *dev)
+{
+	struct topic *topic = dev_to_topic(dev);
+	struct kpub_cursor *c, *tmp;
+	size_t i;
+
+	hrtimer_cancel(&topic->delay_timer);
+	irq_work_sync(&topic->wake_work);
+	for (i = 0; i < topic->ndelayed; ++i)
+		kfree(topic->delayed[i]);
+	kvfree(topic->delayed);
+
+	list_for_each_entry_safe(c, tmp, &topic->cursors, entry)
+		kfree(c);
+	kfree(topic->buf);
+	kfree(topic->stamps);
+	kfree(topic->keys);
+	kfree(topic->key_nodes);
+	kvfree(topic->snap_buf);
+	kfree(topic);
+}
+
+/* Queue a member on its set's ready list and wake the set's readers. */
+static void member_ready(struct kpub_member *m)
+{
+	struct kpub_set *set = m->set;
+	unsigned long flags;
+
+	spin_lock_irqsave(&set->lock, flags);
+	if (list_empty(&m->ready))
+		list_add_tail(&m->ready, &set->ready);
+	spin_unlock_irqrestore(&set->lock, flags);
+
+	wake_up_interruptible(&set->wq);
+}
+
+/* Forward a topic's wakeup to the subscription set reading it. */
+static int member_wake(struct wait_queue_entry *wait, unsigned int mode,
+		       int sync, void *key)
+{
+	member_ready(container_of(wait, struct kpub_member, wait));
+	return 0;
+}
+
+/* Add a topic to a subscription set unless it is already a member. */
+static int set_attach(struct kpub_set *set, struct topic *topic)
+{
+	struct kpub_member *m;
+
+	mutex_lock(&set->mtx);
+
+	list_for_each_entry(m, &set->members, entry) {
+		if (m->kf.topic == topic) {
+			mutex_unlock(&set->mtx);
+			return 0;
+		}
+	}
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m) {
+		mutex_unlock(&set->mtx);
+		return -ENOMEM;
+	}
+
+	m->set = set;
+	m->kf.topic = topic;
+	mutex_init(&m->kf.mtx);
+	INIT_LIST_HEAD(&m->ready);
+	init_waitqueue_func_entry(&m->wait, member_wake);
+	get_device(&topic->dev);
+
+	mutex_lock(&topic->mtx);
+	topic_watch(topic, &m->kf);
+	mutex_unlock(&topic->mtx);
+
+	add_wait_queue(&topic->inq, &m->wait);
+	list_add_tail(&m->entry, &set->members);
+	++set->nmembers;
+
+	mutex_unlock(&set->mtx);
+
+	return 0;
+}
+
+/* Remove a member from its set. Called with the set's mutex held. */
+static void member_detach(struct kpub_member *m)
+{
+	struct topic *topic = m->kf.topic;
+
+	remove_wait_queue(&topic->inq, &m->wait);
+
+	spin_lock_irq(&m->set->lock);
+	list_del(&m->ready);
+	spin_unlock_irq(&m->set->lock);
+
+	mutex_lock(&topic->mtx);
+	topic_unwatch(topic, &m->kf);
+	mutex_unlock(&topic->mtx);
+
+	list_del(&m->entry);
+	--m->set->nmembers;
+	put_device(&topic->dev);
+	kfree(m);
+}
+
+/* Return the length of the first segment of a '/'-separated name. */
+static size_t seg_len(const char *name)
+{
+	return strchrnul(name, '/') - name;
+}
+
+/*
+ * Check a topic name or subscription pattern. Segments may not be empty. In
+ * patterns '+' and '#' must be a whole segment and '#' must be the last one;
+ * topic names may not contain them at all.
+ */
+static bool name_valid(const char *name, bool pattern)
+{
+	size_t len;
+
+	for (;;) {
+		len = seg_len(name);
+		if (len == 0)
+			return false;
+
+		if (memchr(name, '+', len) || memchr(name, '#', len)) {
+			if (!pattern || len != 1)
+				return false;
+			if (name[0] == '#' && name[1])
+				return false;
+		}
+
+		if (!name[len])
+			return true;
+		name += len + 1;
+	}
+}
+
+/* Find the child for a segment. Called with topic_mtx held. */
+static struct trie_node *trie_child(struct trie_node *node, const char *seg,
+				    size_t len)
+{
+	struct trie_node *child;
+
+	list_for_each_entry(child, &node->children, sibling) {
+		if (child->len == len && !memcmp(child->seg, seg, len))
+			return child;
+	}
+
+	return NULL;
+}
+
+/* Free empty nodes from node up towards the root. */
+static void trie_prune(struct trie_node *node)
+{
+	struct trie_node *parent;
+
+	while (node != &trie_root && !node->topic &&
+	       list_empty(&node->children) && list_empty(&node->patterns)) {
+		parent = node->parent;
+		list_del(&node->sibling);
+		kfree(node);
+		node = parent;
+	}
+}
+
+/*
+ * Walk to the node for a name or pattern, creating missing nodes if create is
+ * set. Called with topic_mtx held.
+ */
+static struct trie_node *trie_lookup(const char *name, bool create)
+{
+	struct trie_node *node = &trie_root, *child;
+	size_t len;
+
+	for (;;) {
+		len = seg_len(name);
+		child = trie_child(node, name, len);
+
+		if (!child) {
+			if (!create)
+				return NULL;
+
+			child = kzalloc(struct_size(child, seg, len + 1),
+					GFP_KERNEL);
+			if (!child) {
+				trie_prune(node);
+				return NULL;
+			}
+
+			memcpy(child->seg, name, len);
+			child->len = len;
+			child->parent = node;
+			INIT_LIST_HEAD(&child->children);
+			INIT_LIST_HEAD(&child->patterns);
+			list_add_tail(&child->sibling, &node->children);
+		}
+
+		node = child;
+		if (!name[len])
+			return node;
+		name += len + 1;
+	}
+}
+
+/* Find a topic by name. Called with topic_mtx held. */
+static struct topic *find_topic(const char *name)
+{
+	struct trie_node *node = trie_lookup(name, false);
+	return node ? node->topic : NULL;
+}
+
+/*
+ * Add a topic matched by a pattern to its set. Nothing is published to a
+ * split topic itself, so its partitions are added instead. Called with
+ * topic_mtx held.
+ */
+static void pattern_attach(struct kpub_set *set, struct topic *topic)
+{
+	size_t i;
+
+	if (topic->nparts) {
+		for (i = 0; i < topic->nparts; ++i)
+			pattern_attach(set, topic->parts[i]);
+		return;
+	}
+
+	if (set_attach(set, topic))
+		dev_warn(&topic->dev, "could not add topic to a set\n");
+}
+
+/* Add a topic to the sets of every pattern ending at node. */
+static void trie_attach_patterns(struct trie_node *node, struct topic *topic)
+{
+	struct kpub_pattern *p;
+
+	list_for_each_entry(p, &node->patterns, node_entry)
+		pattern_attach(p->set, topic);
+}
+
+/*
+ * Add a new topic to every set with a matching pattern. name is the part of
+ * the topic's name below node, or NULL once it has all been matched. Only the
+ * literal, '+' and '#' children are visited at each level, so the cost
+ * depends on the name's depth rather than on the number of topics.
+ */
+static void trie_match_patterns(struct trie_node *node, const char *name,
+				struct topic *topic)
+{
+	struct trie_node *child;
+	const char *next;
+	size_t len;
+
+	/* '#' matches the rest of the name, including nothing at all. */
+	child = trie_child(node, "#", 1);
+	if (child)
+		trie_attach_patterns(child, topic);
+
+	if (!name) {
+		trie_attach_patterns(node, topic);
+		return;
+	}
+
+	len = seg_len(name);
+	next = name[len] ? name + len + 1 : NULL;
+
+	child = trie_child(node, "+", 1);
+	if (child)
+		trie_match_patterns(child, next, topic);
+
+	child = trie_child(node, name, len);
+	if (child)
+		trie_match_patterns(child, next, topic);
+}
+
+/* Add every topic at or below node to a set. */
+static void trie_attach_all(struct trie_node *node, struct kpub_set *set)
+{
+	struct trie_node *child;
+
+	if (node->topic)
+		pattern_attach(set, node->topic);
+
+	list_for_each_entry(child, &node->children, sibling)
+		trie_attach_all(child, set);
+}
+
+/*
+ * Add every existing topic matching a new pattern to its set. pattern is the
+ * part of the pattern below node, or NULL once it has all been matched.
+ */
+static void trie_match_topics(struct trie_node *node, const char *pattern,
+			      struct kpub_set *set)
+{
+	struct trie_node *child;
+	const char *next;
+	size_t len;
+
+	if (!pattern) {
+		if (node->topic)
+			pattern_attach(set, node->topic);
+		return;
+	}
+
+	len = seg_len(pattern);
+	next = pattern[len] ? pattern + len + 1 : NULL;
+
+	if (len == 1 && pattern[0] == '#') {
+		trie_attach_all(node, set);
+	} else if (len == 1 && pattern[0] == '+') {
+		list_for_each_entry(child, &node->children, sibling)
+			trie_match_topics(child, next, set);
+	} else {
+		child = trie_child(node, pattern, len);
+		if (child)
+			trie_match_topics(child, next, set);
+	}
+}
+
+static enum hrtimer_restart topic_delay_fire(struct hrtimer *timer);
+static void topic_wake_work(struct irq_work *work);
+
+/*
+ * Create a topic with a validated name. Called with topic_mtx held. The '/'
+ * in hierarchical names become '!' in the device name and directories under
+ * /dev/kpub.
+ */
+static struct topic *create_topic(const char *name)
+{
+	struct trie_node *node;
+	int devt, err, i, minor_num;
+	struct topic *topic;
+
+	node = trie_lookup(name, true);
+	if (!node)
+		return ERR_PTR(-ENOMEM);
+
+	if (node->topic) {
+		pr_alert("%s: topic '%s' already exists\n", THIS_MODULE->name,
+			 name);
+		return ERR_PTR(-EEXIST);
+	}
+
+	topic = (struct topic *)kzalloc(sizeof(*topic), GFP_KERNEL);
+	if (!topic) {
+		err = -ENOMEM;
+		goto cleanup_node;
+	}
+
+	strscpy(topic->name, name, sizeof(topic->name));
+
+	mutex_init(&topic->mtx);
+	spin_lock_init(&topic->lock);
+	init_waitqueue_head(&topic->inq);
+	init_waitqueue_head(&topic->outq);
+	INIT_LIST_HEAD(&topic->wqueue);
+	INIT_LIST_HEAD(&topic->readers);
+	INIT_LIST_HEAD(&topic->watchers);
+	INIT_LIST_HEAD(&topic->groups);
+	INIT_LIST_HEAD(&topic->cursors);
+	INIT_LIST_HEAD(&topic->subs);
+	init_irq_work(&topic->wake_work, topic_wake_work);
+	spin_lock_init(&topic->delay_lock);
+	hrtimer_setup(&topic->delay_timer, topic_delay_fire, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS_SOFT);
+	mutex_init(&topic->snap_mtx);
+	for (i = 0; i < NUM_SNAPS; ++i)
+		seqcount_init(&topic->snaps[i].seq);
+
+	minor_num = reserve_minor_num();
+	if (minor_num < 0) {
+		pr_alert("%s: maximum number of topics (%d) reached\n",
+			 THIS_MODULE->name, NUM_TOPICS);
+		kfree(topic);
+		err = -E2BIG;
+		goto cleanup_node;
+	}
+
+	devt = MKDEV(major_num, minor_num);
+
+	cdev_init(&topic->cdev, &kpub_fops);
+	topic->cdev.owner = THIS_MODULE;
+
+	/*
+	 * From here on the topic is freed by device_release. Adding the cdev
+	 * and device together makes every open file pin the topic, so it
+	 * outlives remove_topic until the last file is closed.
+	 */
+	device_initialize(&topic->dev);
+	topic->dev.class = &kpub_class;
+	topic->dev.release = device_release;
+	topic->dev.devt = devt;
+	topic->dev.id = minor_num;
+
+	err = dev_set_name(&topic->dev, "kpub!%s", topic->name);
+	if (err < 0) {
+		pr_alert("%s: could not set topic '%s' name\n",
+			 THIS_MODULE->name, topic->name);
+		goto cleanup_dev;
+	}
+
+	err = cdev_device_add(&topic->cdev, &topic->dev);
+	if (err) {
+		pr_alert("%s: could not add device '%s'\n", THIS_MODULE->name,
+			 topic->name);
+		goto cleanup_dev;
+	}
+
+	list_add(&topic->entry, &topics);
+	rcu_assign_pointer(topic_ids[minor_num], topic);
+	node->topic = topic;
+	topic->node = node;
+
+	trie_match_patterns(&trie_root, topic->name, topic);
+
+	return topic;
+
+cleanup_dev:
+	release_minor_num(minor_num);
+	put_device(&topic->dev);
+cleanup_node:
+	trie_prune(node);
+
+	return ERR_PTR(err);
+}
+
+/*
+ * Create a new topic by writing its name to the class attribute. Names are
+ * '/'-separated paths, such as sensors/imu/accel.
+ */
+static ssize_t create_topic_store(const struct class *cp,
+				  const struct class_attribute *attr,
+				  const char *buf, size_t len)
+{
+	char name[MAX_STR_LEN] = { 0 };
+	size_t name_len = len;
+	struct topic *topic;
+
+	if (name_len && buf[name_len - 1] == '\n')
+		--name_len;
+
+	if (name_len == 0) {
+		pr_alert("%s: topic cannot have an empty name\n",
+			 THIS_MODULE->name);
+		return -EINVAL;
+	}
+
+	if (name_len >= MAX_STR_LEN) {
+		pr_alert("%s: topic too long, max %d bytes\n",
+			 THIS_MODULE->name, MAX_STR_LEN - 1);
+		return -EINVAL;
+	}
+
+	memcpy(name, buf, name_len);
+
+	if (!name_valid(name, false)) {
+		pr_alert("%s: invalid topic name '%s'\n", THIS_MODULE->name,
+			 name);
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&topic_mtx))
+		return -ERESTARTSYS;
+
+	topic = create_topic(name);
+
+	mutex_unlock(&topic_mtx);
+
+	return IS_ERR(topic) ? PTR_ERR(topic) : len;
+}
+
+/*
+ * Delete a topic, and any partitions, and drop the registry's reference to
+ * it. Called with topic_mtx held.
+ */
+static void delete_topic(struct topic *topic)
+{
+	topic_drop_parts(topic);
+
+	RCU_INIT_POINTER(topic_ids[topic->dev.id], NULL);
+	synchronize_rcu();
+
+	release_minor_num(topic->dev.id);
+	list_del(&topic->entry);
+	topic->node->topic = NULL;
+	trie_prune(topic->node);
+	cdev_device_del(&topic->cdev, &topic->dev);
+	put_device(&topic->dev);
+}
+
+/* Remove a topic by writing its name to the class attribute. */
+static ssize_t remove_topic_store(const struct class *cls,
+				  const struct class_attribute *attr,
+				  const char *buf, size_t len)
+{
+	char name[MAX_STR_LEN] = { 0 };
+	size_t name_len = len;
+	struct topic *topic;
+
+	if (name_len && buf[name_len - 1] == '\n')
+		--name_len;
+
+	if (name_len == 0 || name_len >= MAX_STR_LEN) {
+		pr_alert("%s: topic too long, max %d bytes\n",
+			 THIS_MODULE->name, MAX_STR_LEN - 1);
+		return -EINVAL;
+	}
+
+	memcpy(name, buf, name_len);
+
+	if (mutex_lock_interruptible(&topic_mtx))
+		return -ERESTARTSYS;
+
+	topic = find_topic(name);
+	if (!topic) {
+		mutex_unlock(&topic_mtx);
+		return -ENODEV;
+	}
+
+	if (topic->parent) {
+		pr_alert("%s: remove partition '%s' through its topic\n",
+			 THIS_MODULE->name, name);
+		mutex_unlock(&topic_mtx);
+		return -EBUSY;
+	}
+
+	delete_topic(topic);
+
+	mutex_unlock(&topic_mtx);
+
+	return len;
+}
+
+/*
+ * Default class sysfs attributes:
+ *  - create_topic
+ * 	- remove_topic
+ */
+CLASS_ATTR_WO(create_topic);
+CLASS_ATTR_WO(remove_topic);
+static struct attribute *class_attrs[] = {
+	&class_attr_create_topic.attr,
+	&class_attr_remove_topic.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(class);
+
+static struct class kpub_class = {
+	.name = "kpub",
+	.dev_groups = topic_groups,
+	.class_groups = class_groups,
+};
+
+/* Open the device for reading xor writing. */
+static int kpub_open(struct inode *inode, struct file *file)
+{
+	struct topic *topic = cdev_to_topic(inode->i_cdev);
+	struct kpub_file *kf;
+	int err = 0;
+
+	kf = kzalloc(sizeof(*kf), GFP_KERNEL);
+	if (!kf)
+		return -ENOMEM;
+
+	kf->topic = topic;
+	mutex_init(&kf->mtx);
+
+	if (mutex_lock_interruptible(&topic->mtx)) {
+		kfree(kf);
+		return -ERESTARTSYS;
+	}
+
+	if (topic->nparts && !topic->lanes && file->f_mode & FMODE_READ) {
+		dev_err(&topic->dev,
+			"read partitions directly or through a subscription set\n");
+		err = -EINVAL;
+		goto cleanup;
+	}
+
+	err = topic_alloc_buf(topic);
+	if (err)
+		goto cleanup;
+
+	if (file->f_mode & FMODE_READ && !(file->f_mode & FMODE_WRITE) &&
+	    topic->lanes) {
+		err = topic_add_lane_reader(topic, kf);
+		if (err)
+			goto cleanup;
+	} else if (file->f_mode & FMODE_READ && !(file->f_mode & FMODE_WRITE)) {
+		kf->evictable = true;
+		topic_add_reader(topic, kf);
+	} else if (file->f_mode & FMODE_WRITE && !(file->f_mode & FMODE_READ)) {
+		++topic->nwriters;
+		topic_hold_parts(topic, 1);
+	} else {
+		dev_err(&topic->dev,
+			"topic must be opened as reader xor writer");
+		err = -EACCES;
+		goto cleanup;
+	}
+
+	/* Positioned reads go through KPUB_IOC_PREAD. */
+	file->f_mode &= ~FMODE_PREAD;
+	file->private_data = kf;
+
+	dev_info(
+		&topic->dev,
+		"opening new file, nreaders = %lu, nwriters = %lu, offset = %lld\n",
+		topic->nreaders, topic->nwriters, file->f_pos);
+
+cleanup:
+	mutex_unlock(&topic->mtx);
+
+	if (err)
+		kfree(kf);
+
+	return err;
+}
+
+static int kpub_release(struct inode *inode, struct file *file)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+
+	if (kf->group && kf->group->leases)
+		group_drop_member(kf->group, kf);
+
+	mutex_lock(&topic->mtx);
+
+	if (kf->cursor)
+		kf->cursor->reader = NULL;
+
+	if (file->f_mode & FMODE_READ && kf->group) {
+		topic_leave_group(topic, kf);
+		--topic->nreaders;
+	} else if (kf->lanes) {
+		topic_del_lane_reader(topic, kf);
+	} else if (file->f_mode & FMODE_READ) {
+		topic_del_reader(topic, kf);
+	} else {
+		--topic->nwriters;
+		topic_hold_parts(topic, -1);
+	}
+
+	mutex_unlock(&topic->mtx);
+
+	if (rcu_access_pointer(kf->filter))
+		bpf_prog_destroy(rcu_dereference_protected(kf->filter, true));
+	kfree(rcu_access_pointer(kf->preds));
+	kfree(kf);
+
+	return 0;
+}
+
+/*
+ * Copy accepted messages from seq onwards without consuming them. Never
+ * blocks, and returns 0 at the tail. If seq is behind the cursor, the cursor
+ * is pulled back to it for the copy so those slots cannot be reused. Unlike
+ * reader_seek this leaves a pending eviction for the next read to report.
+ */
+static ssize_t reader_pread(struct kpub_file *kf, char __user *buf,
+			    size_t max, size_t rec, size_t hdr_size, u64 seq)
+{
+	struct topic *topic = kf->topic;
+	u64 rp = kf->rp, wp;
+	ssize_t err = 0;
+	size_t n = 0;
+	char *msg;
+
+	if (seq < rp) {
+		spin_lock_irq(&topic->lock);
+		if (seq < topic_first(topic)) {
+			err = -ENXIO;
+		} else {
+			smp_store_release(&kf->rp, seq);
+			topic->tail = min(topic->tail, seq);
+		}
+		spin_unlock_irq(&topic->lock);
+		if (err)
+			return err;
+	}
+
+	wp = smp_load_acquire(&topic->wp);
+	if (seq > wp) {
+		err = -ENXIO;
+		goto out;
+	}
+
+	for (; seq != wp && n < max; ++seq) {
+		if (!reader_accept(kf, seq))
+			continue;
+		msg = topic_slot(topic, seq);
+		if (copy_to_user(buf + n * rec, msg - hdr_size, rec)) {
+			err = -EFAULT;
+			break;
+		}
+		++n;
+	}
+
+	/* An evicted reader's slots may have been reused as it copied them. */
+	smp_rmb();
+	if (READ_ONCE(kf->lagged)) {
+		err = -EPIPE;
+		n = 0;
+	}
+
+out:
+	if (rp != kf->rp)
+		reader_advance(kf, rp);
+
+	return n ? n * rec : err;
+}
+
+/*
+ * Copy the latest snapshot if it is newer than the one the reader last read.
+ * Returns msg_size, 0 if there is nothing new, or an error.
+ */
+static ssize_t reader_read_snap(struct kpub_file *kf, char __user *buf)
+{
+	struct topic *topic = kf->topic;
+	struct kpub_snap *snap;
+	unsigned int seq;
+	unsigned long left;
+	u64 gen;
+
+	for (;;) {
+		snap = &topic->snaps[smp_load_acquire(&topic->snap_latest)];
+
+		seq = raw_read_seqcount(&snap->seq);
+		if (seq & 1)
+			continue;
+
+		gen = snap->gen;
+		if (gen == kf->gen)
+			left = 0;
+		else
+			left = copy_to_user(buf, snap->data, topic->msg_size);
+
+		if (read_seqcount_retry(&snap->seq, seq))
+			continue;
+
+		if (gen == kf->gen)
+			return 0;
+		if (left)
+			return -EFAULT;
+
+		kf->gen = gen;
+		return topic->msg_size;
+	}
+}
+
+/*
+ * Report an eviction once, moving the reader to where the producer left it.
+ * Called with the reader's mutex held.
+ */
+static int reader_check_lag(struct kpub_file *kf)
+{
+	struct topic *topic = kf->topic;
+
+	if (!READ_ONCE(kf->lagged))
+		return 0;
+
+	spin_lock_irq(&topic->lock);
+	smp_store_release(&kf->rp, kf->lag_to);
+	kf->lagged = false;
+	spin_unlock_irq(&topic->lock);
+
+	return -EPIPE;
+}
+
+/*
+ * Copy up to max accepted messages from the reader's cursor and move it past
+ * them. Fails with EPIPE if the reader was evicted meanwhile, leaving the
+ * eviction for reader_check_lag to report. Called with the reader's mutex
+ * held.
+ */
+static ssize_t reader_copy(struct kpub_file *kf, char __user *buf, size_t max,
+			   size_t rec, size_t hdr_size)
+{
+	struct topic *topic = kf->topic;
+	u64 rp, wp, now, expired = 0;
+	size_t n = 0;
+	int err = 0;
+	char *msg;
+
+	wp = smp_load_acquire(&topic->wp);
+	now = topic_expiry_now(topic);
+	for (rp = kf->rp; rp != wp && n < max; ++rp) {
+		if (topic_expired(topic, rp, now)) {
+			++expired;
+			continue;
+		}
+		if (!reader_accept(kf, rp))
+			continue;
+		msg = topic_slot(topic, rp);
+		if (copy_to_user(buf + n * rec, msg - hdr_size, rec)) {
+			err = -EFAULT;
+			break;
+		}
+		++n;
+	}
+
+	/* An evicted reader's slots may have been reused as it copied them. */
+	smp_rmb();
+	if (READ_ONCE(kf->lagged))
+		return -EPIPE;
+
+	if (expired)
+		atomic_long_add(expired, &topic->expired);
+
+	dev_dbg(&topic->dev, "read: n = %lu, rp = %llu -> %llu\n", n, kf->rp,
+		rp);
+
+	reader_advance(kf, rp);
+
+	return n ? n * rec : err;
+}
+
+/*
+ * Read messages through a consumer group. Members wait exclusively, so each
+ * publish wakes one of them, and whoever reads passes the wakeup on if it
+ * left messages behind.
+ */
+static ssize_t group_read(struct kpub_group *g, struct kpub_file *kf,
+			  char __user *buf, size_t max, size_t rec,
+			  size_t hdr_size, bool nonblock)
+{
+	ssize_t ret;
+
+	if (mutex_lock_interruptible(&g->kf.mtx))
+		return -ERESTARTSYS;
+
+	ret = reader_check_lag(&g->kf);
+	if (ret) {
+		mutex_unlock(&g->kf.mtx);
+		return ret;
+	}
+
+	while (!group_ready(g)) {
+		mutex_unlock(&g->kf.mtx);
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible_exclusive(g->wq,
+						       group_pending(g))) {
+			/* Do not swallow a wakeup meant for the group. */
+			if (group_pending(g))
+				wake_up_interruptible(&g->wq);
+			return -ERESTARTSYS;
+		}
+		if (mutex_lock_interruptible(&g->kf.mtx))
+			return -ERESTARTSYS;
+	}
+
+	if (g->leases)
+		ret = group_copy(g, kf, buf, max, rec, hdr_size);
+	else
+		ret = reader_copy(&g->kf, buf, max, rec, hdr_size);
+	if (ret == -EPIPE)
+		ret = reader_check_lag(&g->kf);
+
+	if (group_ready(g))
+		wake_up_interruptible(&g->wq);
+
+	mutex_unlock(&g->kf.mtx);
+
+	return ret;
+}
+
+/* Return whether any lane has messages left, without the reader's mutex. */
+static bool lanes_pending(struct kpub_file *kf)
+{
+	struct kpub_file *lane;
+	size_t i;
+
+	for (i = 0; i < kf->topic->nparts; ++i) {
+		lane = &kf->lanes[i];
+		if (READ_ONCE(lane->lagged) ||
+		    smp_load_acquire(&lane->rp) !=
+			    smp_load_acquire(&lane->topic->wp))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Read a topic with lanes, taking messages from the highest lane that has
+ * any before moving down. Lanes keep their own cursors, so messages stay in
+ * order within a lane. Lanes must keep the topic's geometry.
+ */
+static ssize_t lanes_read(struct file *file, char __user *buf, size_t max,
+			  size_t rec, size_t hdr_size)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	struct kpub_file *lane;
+	ssize_t ret = 0;
+	size_t i, n;
+
+	for (i = 0; i < topic->nparts; ++i) {
+		lane = &kf->lanes[i];
+		if (lane->topic->msg_size != topic->msg_size ||
+		    (hdr_size && lane->topic->hdr_size != hdr_size))
+			return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	for (;;) {
+		n = 0;
+		for (i = topic->nparts; i-- && n < max;) {
+			lane = &kf->lanes[i];
+			if (READ_ONCE(lane->lagged))
+				ret = -EPIPE;
+			else if (reader_pending(lane))
+				ret = reader_copy(lane, buf + n * rec, max - n,
+						  rec, hdr_size);
+			else
+				continue;
+			/*
+			 * Report an eviction on its own, keeping it pending
+			 * behind messages already copied from higher lanes.
+			 */
+			if (ret == -EPIPE && !n)
+				ret = reader_check_lag(lane);
+			if (ret < 0)
+				break;
+			n += ret / rec;
+		}
+
+		if (n || ret < 0)
+			break;
+
+		mutex_unlock(&kf->mtx);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(topic->inq, lanes_pending(kf)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&kf->mtx))
+			return -ERESTARTSYS;
+	}
+
+	mutex_unlock(&kf->mtx);
+
+	return n ? n * rec : ret;
+}
+
+/*
+ * Read the latest snapshot, waiting for one newer than the last read unless
+ * the file is non-blocking.
+ */
+static ssize_t kpub_read_snap(struct file *file, char __user *buf, size_t len)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	ssize_t ret;
+
+	if (len < topic->msg_size) {
+		dev_err(&topic->dev, "read length must be at least msg_size\n");
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	while ((ret = reader_read_snap(kf, buf)) == 0) {
+		mutex_unlock(&kf->mtx);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(topic->inq,
+					     READ_ONCE(topic->snap_gen) !=
+						     kf->gen))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&kf->mtx))
+			return -ERESTARTSYS;
+	}
+
+	mutex_unlock(&kf->mtx);
+
+	return ret;
+}
+
+/*
+ * Read messages from the cursor, which is also the file position. Retained
+ * messages at other positions are read with KPUB_IOC_PREAD instead of
+ * pread(2), which cannot be told apart from a read at the current position.
+ */
+static ssize_t kpub_read(struct file *file, char __user *buf, size_t len,
+			 loff_t *off)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	size_t hdr_size = kf->header ? topic->hdr_size : 0;
+	size_t rec = hdr_size + topic->msg_size, max = len / rec;
+	ssize_t ret;
+	u64 rp;
+
+	if (topic->snapshot)
+		return kpub_read_snap(file, buf, len);
+
+	if (max == 0) {
+		dev_err(&topic->dev, "read length must be at least %lu\n", rec);
+		return -EINVAL;
+	}
+
+	if (kf->lanes)
+		return lanes_read(file, buf, max, rec, hdr_size);
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	if (kf->group) {
+		mutex_unlock(&kf->mtx);
+		return group_read(kf->group, kf, buf, max, rec, hdr_size,
+				  file->f_flags & O_NONBLOCK);
+	}
+
+	ret = reader_check_lag(kf);
+	if (ret) {
+		mutex_unlock(&kf->mtx);
+		return ret;
+	}
+
+	while (!reader_pending(kf)) {
+		mutex_unlock(&kf->mtx);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (reader_wait(kf, &rp))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&kf->mtx))
+			return -ERESTARTSYS;
+		ret = reader_check_lag(kf);
+		if (ret) {
+			mutex_unlock(&kf->mtx);
+			return ret;
+		}
+		/* Everything before rp was rejected while we slept. */
+		if (rp > kf->rp)
+			reader_advance(kf, rp);
+	}
+
+	ret = reader_copy(kf, buf, max, rec, hdr_size);
+	if (ret == -EPIPE)
+		ret = reader_check_lag(kf);
+	*off = kf->rp;
+
+	mutex_unlock(&kf->mtx);
+
+	return ret;
+}
+
+/*
+ * Move a reader's cursor, in messages. SEEK_SET goes to a sequence number,
+ * SEEK_END is relative to the tail and SEEK_DATA goes to the oldest retained
+ * message at or after the offset. Positions outside the retained messages
+ * fail with ENXIO.
+ */
+static loff_t kpub_llseek(struct file *file, loff_t off, int whence)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	loff_t pos;
+	int err;
+
+	if (!(file->f_mode & FMODE_READ) || kf->group || kf->lanes)
+		return -ESPIPE;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = off;
+		break;
+	case SEEK_CUR:
+		pos = kf->rp + off;
+		break;
+	case SEEK_END:
+		pos = READ_ONCE(topic->wp) + off;
+		break;
+	case SEEK_DATA:
+		spin_lock_irq(&topic->lock);
+		pos = max_t(u64, off, topic_first(topic));
+		spin_unlock_irq(&topic->lock);
+		break;
+	default:
+		mutex_unlock(&kf->mtx);
+		return -EINVAL;
+	}
+
+	err = pos < 0 ? -ENXIO : reader_seek(kf, pos);
+	if (!err) {
+		kf->start = pos;
+		file->f_pos = pos;
+	}
+
+	mutex_unlock(&kf->mtx);
+
+	return err ? err : pos;
+}
+
+/*
+ * Copy one message into a slot from a user or kernel buffer. Called with the
+ * topic's lock held, so user copies run with page faults disabled and fail
+ * instead of sleeping when the source page is not resident.
+ */
+static int topic_copy_in(char *slot, const void *src, size_t size, bool user)
+{
+	unsigned long left;
+
+	if (!user) {
+		memcpy(slot, src, size);
+		return 0;
+	}
+
+	pagefault_disable();
+	left = __copy_from_user_inatomic(slot, (const void __user *)src, size);
+	pagefault_enable();
+
+	return left ? -EFAULT : 0;
+}
+
+/* Hand a freshly published snapshot to kernel subscribers. */
+static void topic_notify_snap(struct topic *topic, struct kpub_snap *snap)
+{
+	struct kpub_sub *sub;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &topic->subs, entry)
+		sub->cb(sub->priv, snap->data, topic->msg_size);
+	rcu_read_unlock();
+}
+
+/* Hand freshly published messages to kernel subscribers. */
+static void topic_notify(struct topic *topic, u64 seq, size_t n)
+{
+	struct kpub_sub *sub;
+	size_t i;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &topic->subs, entry) {
+		for (i = 0; i < n; ++i)
+			sub->cb(sub->priv, topic_slot(topic, seq + i),
+				topic->msg_size);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Fill in the headers of n messages copied in at wp. Publishers outside task
+ * context, such as BPF programs and interrupt handlers, are reported as pid 0.
+ */
+static void topic_fill_hdrs(struct topic *topic, size_t n, u64 ns)
+{
+	struct kpub_hdr hdr = {
+		.ns = ns,
+		.pid = in_task() ? task_tgid_nr(current) : 0,
+		.len = topic->msg_size,
+	};
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		hdr.seq = topic->wp + i;
+		memcpy(topic_hdr(topic, topic->wp + i), &hdr, sizeof(hdr));
+	}
+}
+
+/*
+ * Stamp the n slots at wp with consecutive global sequence numbers and the
+ * time, and return the time. Called with the topic's lock held, possibly
+ * from NMI-context BPF programs, hence the fast clock.
+ */
+static u64 topic_set_stamps(struct topic *topic, size_t n)
+{
+	u64 seq = atomic64_add_return(n, &kpub_seq) - n;
+	u64 ns = ktime_get_mono_fast_ns();
+	struct kpub_stamp *stamp;
+	size_t i;
+
+	/*
+	 * The fast clock can step back slightly across CPUs. Keep stamps in
+	 * order along the ring so readers can binary search them.
+	 */
+	if (topic->wp != topic->base)
+		ns = max(ns, topic_stamp(topic, topic->wp - 1)->ns);
+
+	for (i = 0; i < n; ++i) {
+		stamp = topic_stamp(topic, topic->wp + i);
+		stamp->seq = seq + i;
+		stamp->ns = ns;
+	}
+
+	return ns;
+}
+
+/* Return the index bucket for a message's key. */
+static struct hlist_head *topic_key_head(struct topic *topic, const char *msg)
+{
+	u32 hash = jhash(msg + topic->key_offset, topic->key_len, 0);
+	return &topic->keys[hash_32(hash, topic->key_bits)];
+}
+
+/*
+ * Make a freshly copied message its key's latest value, retiring the slot
+ * that held the previous one. Called with the topic's lock held.
+ */
+static void topic_index_key(struct topic *topic, u64 seq)
+{
+	struct kpub_key *key = topic_key(topic, seq), *old;
+	const char *msg = topic_slot(topic, seq);
+	struct hlist_head *head = topic_key_head(topic, msg);
+
+	hlist_for_each_entry(old, head, node) {
+		if (!memcmp(topic_key_of(topic, old), msg + topic->key_offset,
+			    topic->key_len)) {
+			hlist_del_init(&old->node);
+			--topic->nlive;
+			break;
+		}
+	}
+
+	WRITE_ONCE(key->orig, seq);
+	hlist_add_head(&key->node, head);
+	++topic->nlive;
+}
+
+/*
+ * Make n messages copied in at wp visible to readers, expiring after ttl
+ * nanoseconds or the topic's default if ttl is 0.
+ */
+static void topic_commit(struct topic *topic, size_t n, u64 ttl)
+{
+	u64 ns = topic_set_stamps(topic, n), expires = 0;
+	size_t i;
+
+	if (!ttl)
+		ttl = READ_ONCE(topic->ttl_us) * NSEC_PER_USEC;
+	if (ttl) {
+		/* A ttl too long to represent never expires in practice. */
+		if (check_add_overflow(ns, ttl, &expires))
+			expires = U64_MAX;
+		if (!topic->ttls)
+			WRITE_ONCE(topic->ttls, true);
+	}
+	for (i = 0; i < n; ++i)
+		topic_stamp(topic, topic->wp + i)->expires = expires;
+
+	if (topic->hdr_size)
+		topic_fill_hdrs(topic, n, ns);
+
+	if (topic->key_len) {
+		for (i = 0; i < n; ++i)
+			topic_index_key(topic, topic->wp + i);
+	}
+
+	topic_notify(topic, topic->wp, n);
+	smp_store_release(&topic->wp, topic->wp + n);
+}
+
+/*
+ * Carry the live message in the slot at wp forward by renumbering the slot
+ * as wp. The message stays where it is, so nothing is copied, and readers
+ * that already saw it skip it by its original sequence number.
+ */
+static void topic_carry(struct topic *topic)
+{
+	topic_set_stamps(topic, 1);
+	smp_store_release(&topic->wp, topic->wp + 1);
+}
+
+/*
+ * Return how many of count messages can be copied in at wp now. Compacted
+ * topics keep every key's latest value: live messages at wp are carried
+ * forward, and the run of writable slots ends at the next live one. If every
+ * slot is live, the oldest key is dropped instead. Called with the topic's
+ * lock held.
+ */
+static size_t topic_claim(struct topic *topic, size_t count)
+{
+	size_t i, n = min_t(u64, count, topic_space(topic));
+
+	if (!topic->key_len)
+		return n;
+
+	while (n && topic_key_live(topic, topic->wp)) {
+		if (topic->nlive == topic->msg_count) {
+			hlist_del_init(&topic_key(topic, topic->wp)->node);
+			--topic->nlive;
+			++topic->dropped;
+			break;
+		}
+		topic_carry(topic);
+		n = min_t(u64, n, topic_space(topic));
+	}
+
+	for (i = 0; i < n && !topic_key_live(topic, topic->wp + i); ++i)
+		;
+
+	return i;
+}
+
+/*
+ * Wake the topic's readers after a publish, and those reading it as a lane
+ * through its parent.
+ */
+static void topic_wake_readers(struct topic *topic)
+{
+	struct topic *parent = topic->parent;
+
+	wake_up_interruptible(&topic->inq);
+
+	if (parent && READ_ONCE(parent->lanes))
+		wake_up_interruptible(&parent->inq);
+}
+
+/* Wake readers after an NMI-context publish, which could not. */
+static void topic_wake_work(struct irq_work *work)
+{
+	topic_wake_readers(container_of(work, struct topic, wake_work));
+}
+
+/*
+ * Replace a snapshot topic's state. The oldest version is rewritten, so the
+ * latest stays intact for readers until the new one is published; a reader
+ * still copying the rewritten version sees its count change and retries.
+ */
+static int topic_publish_snap(struct topic *topic, const void *src, bool user)
+{
+	struct kpub_snap *snap;
+	unsigned int next;
+	int err = 0;
+
+	if (mutex_lock_interruptible(&topic->snap_mtx))
+		return -ERESTARTSYS;
+
+	next = (topic->snap_latest + 1) % NUM_SNAPS;
+	snap = &topic->snaps[next];
+
+	/*
+	 * Writers are serialized by snap_mtx, and the copy from user space may
+	 * fault, so the write section stays preemptible. A reader spinning on
+	 * it reloads snap_latest, which never names the version being written.
+	 */
+	raw_write_seqcount_begin(&snap->seq);
+	if (!user)
+		memcpy(snap->data, src, topic->msg_size);
+	else if (copy_from_user(snap->data, (const void __user *)src,
+				topic->msg_size))
+		err = -EFAULT;
+	snap->gen = topic->snap_gen + 1;
+	raw_write_seqcount_end(&snap->seq);
+
+	if (!err) {
+		smp_store_release(&topic->snap_latest, next);
+		WRITE_ONCE(topic->snap_gen, snap->gen);
+		topic_notify_snap(topic, snap);
+	}
+
+	mutex_unlock(&topic->snap_mtx);
+
+	if (!err)
+		wake_up_interruptible(&topic->inq);
+
+	return err;
+}
+
+static ssize_t topic_publish(struct topic *topic, const void *src,
+			     size_t count, bool user, bool nonblock, u64 ttl);
+
+/* Wake a queued writer only when it is its turn. */
+static int writer_wake(struct wait_queue_entry *wait, unsigned int mode,
+		       int sync, void *key)
+{
+	struct writer_waiter *ww = container_of(wait, struct writer_waiter, wait);
+
+	if (!READ_ONCE(ww->turn))
+		return 0;
+
+	return default_wake_function(wait, mode, sync, key);
+}
+
+/*
+ * Return whether a writer may claim slots: no one is queued ahead of it.
+ * Called with the topic's lock held.
+ */
+static inline bool writer_turn(struct topic *topic, struct writer_waiter *ww)
+{
+	return !topic->nqueued || ww->turn;
+}
+
+/* Queue a writer for room. Called with the topic's lock held. */
+static void writer_enqueue(struct topic *topic, struct writer_waiter *ww)
+{
+	ww->turn = list_empty(&topic->wqueue);
+	ww->start = ktime_get_mono_fast_ns();
+	list_add_tail(&ww->entry, &topic->wqueue);
+	++topic->nqueued;
+}
+
+/*
+ * Take a writer off the queue and give the next one its turn, which the
+ * caller wakes once it drops the lock. Called with the topic's lock held.
+ */
+static void writer_dequeue(struct topic *topic, struct writer_waiter *ww)
+{
+	struct writer_waiter *next;
+
+	list_del_init(&ww->entry);
+	--topic->nqueued;
+
+	next = list_first_entry_or_null(&topic->wqueue, struct writer_waiter,
+					entry);
+	if (next)
+		WRITE_ONCE(next->turn, true);
+}
+
+/* Count how long a writer waited in the topic's histogram. */
+static void writer_record_wait(struct topic *topic, struct writer_waiter *ww)
+{
+	u64 us = div_u64(ktime_get_mono_fast_ns() - ww->start, NSEC_PER_USEC);
+
+	atomic_long_inc(
+		&topic->wait_hist[min_t(int, fls64(us), NUM_WAIT_BUCKETS - 1)]);
+}
+
+/*
+ * Sleep until it is the writer's turn and there is room. Waits are
+ * exclusive and the wake function skips writers whose turn it is not, so
+ * room made by a reader wakes exactly the writer at the head of the queue.
+ * With max_lag_ms set, a stuck reader only becomes evictable with time, so
+ * look again at least that often.
+ */
+static int writer_wait(struct topic *topic, struct writer_waiter *ww)
+{
+	unsigned int ms = READ_ONCE(topic->max_lag_ms);
+	long timeout = ms ? msecs_to_jiffies(ms) : MAX_SCHEDULE_TIMEOUT;
+	int err = 0;
+
+	add_wait_queue_exclusive(&topic->outq, &ww->wait);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (READ_ONCE(ww->turn) && topic_writable(topic))
+			break;
+		if (signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		if (!schedule_timeout(timeout))
+			break;
+	}
+
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&topic->outq, &ww->wait);
+
+	return err;
+}
+
+/*
+ * Pick the partition for a message by hashing its key. The key is read in
+ * chunks so that keys of any length hash the same from user and kernel
+ * memory.
+ */
+static int topic_route(struct topic *topic, const char *msg, bool user,
+		       size_t *part)
+{
+	size_t off, len;
+	char chunk[64];
+	u32 hash = 0;
+
+	for (off = 0; off < topic->key_len; off += len) {
+		len = min(topic->key_len - off, sizeof(chunk));
+		if (!user)
+			memcpy(chunk, msg + topic->key_offset + off, len);
+		else if (copy_from_user(chunk,
+					(const char __user *)msg +
+						topic->key_offset + off,
+					len))
+			return -EFAULT;
+		hash = jhash(chunk, len, hash);
+	}
+
+	*part = hash % topic->nparts;
+	return 0;
+}
+
+/*
+ * Publish messages to a partitioned topic. Keyed messages are routed by key,
+ * in runs of consecutive messages for the same partition, so each key keeps
+ * its order. Without a key, each call goes to the next partition in turn.
+ */
+static ssize_t topic_publish_parts(struct topic *topic, const void *src,
+				   size_t count, bool user, bool nonblock,
+				   u64 ttl)
+{
+	size_t done = 0, run, part, next = 0;
+	struct topic *dst;
+	ssize_t n;
+	int err;
+
+	if (topic->lanes || !topic->key_len) {
+		part = topic->lanes ? 0 :
+				      (u32)atomic_inc_return(&topic->rr) %
+					      topic->nparts;
+		dst = topic->parts[part];
+		if (dst->msg_size != topic->msg_size)
+			return -EINVAL;
+		return topic_publish(dst, src, count, user, nonblock, ttl);
+	}
+
+	err = topic_route(topic, src, user, &part);
+
+	while (!err && done < count) {
+		for (run = 1; done + run < count; ++run) {
+			err = topic_route(topic,
+					  src + (done + run) * topic->msg_size,
+					  user, &next);
+			if (err || next != part)
+				break;
+		}
+
+		dst = topic->parts[part];
+		if (dst->msg_size != topic->msg_size) {
+			err = -EINVAL;
+			break;
+		}
+
+		n = topic_publish(dst, src + done * topic->msg_size, run, user,
+				  nonblock, ttl);
+		if (n < 0) {
+			err = n;
+			break;
+		}
+
+		done += n;
+		if (n < run)
+			break;
+		part = next;
+	}
+
+	return done ? done : err;
+}
+
+/*
+ * Publish up to count messages from src in one hold of the producer lock,
+ * sleeping until at least one slot is free unless nonblock is set. Returns
+ * the number of messages published.
+ */
+static ssize_t topic_publish_chunk(struct topic *topic, const void *src,
+				   size_t count, bool user, bool nonblock,
+				   u64 ttl)
+{
+	struct writer_waiter ww = { .entry = LIST_HEAD_INIT(ww.entry) };
+	unsigned long flags;
+	bool queued;
+	size_t i, n;
+	int err = 0;
+
+retry:
+	/*
+	 * Fault the source in up front so the copies under the lock succeed.
+	 * If a page is reclaimed in between and nothing could be copied, come
+	 * back here and try again.
+	 */
+	if (user && fault_in_readable((const char __user *)src,
+				      count * topic->msg_size))
+		err = -EFAULT;
+
+	spin_lock_irqsave(&topic->lock, flags);
+
+	/* Writers that find the topic full queue up and are served in order. */
+	while (!err &&
+	       (!writer_turn(topic, &ww) || (n = topic_claim(topic, count)) == 0)) {
+		if (nonblock) {
+			err = -EAGAIN;
+			break;
+		}
+		if (list_empty(&ww.entry)) {
+			init_waitqueue_func_entry(&ww.wait, writer_wake);
+			ww.wait.private = current;
+			writer_enqueue(topic, &ww);
+		}
+		spin_unlock_irqrestore(&topic->lock, flags);
+		err = writer_wait(topic, &ww);
+		spin_lock_irqsave(&topic->lock, flags);
+	}
+
+	if (err) {
+		queued = !list_empty(&ww.entry);
+		if (queued)
+			writer_dequeue(topic, &ww);
+		spin_unlock_irqrestore(&topic->lock, flags);
+		if (queued)
+			wake_up_interruptible(&topic->outq);
+		return err;
+	}
+
+	for (i = 0; i < n; ++i) {
+		err = topic_copy_in(topic_slot(topic, topic->wp + i),
+				    src + i * topic->msg_size, topic->msg_size,
+				    user);
+		if (err)
+			break;
+	}
+
+	if (i)
+		topic_commit(topic, i, ttl);
+
+	/* Keep the turn if nothing could be copied. */
+	queued = i && !list_empty(&ww.entry);
+	if (queued)
+		writer_dequeue(topic, &ww);
+
+	spin_unlock_irqrestore(&topic->lock, flags);
+
+	if (queued) {
+		writer_record_wait(topic, &ww);
+		wake_up_interruptible(&topic->outq);
+	}
+
+	if (!i)
+		goto retry;
+
+	dev_dbg(&topic->dev, "published %lu messages from %s space, wp = %llu\n",
+		i, user ? "user" : "kernel", READ_ONCE(topic->wp));
+
+	topic_wake_readers(topic);
+
+	return i;
+}
+
+/*
+ * Publish up to count messages from src, sleeping until at least one slot is
+ * free unless nonblock is set. Returns the number of messages published.
+ * Messages are copied in chunks of at most MAX_LOCKED_COPY bytes, since the
+ * producer lock is held with interrupts disabled while they are copied. Only
+ * the first chunk may sleep; the rest stop at the first full ring.
+ */
+static ssize_t topic_publish(struct topic *topic, const void *src,
+			     size_t count, bool user, bool nonblock, u64 ttl)
+{
+	size_t chunk, done = 0;
+	ssize_t n;
+	int err;
+
+	if (count == 0)
+		return 0;
+
+	if (topic->nparts)
+		return topic_publish_parts(topic, src, count, user, nonblock,
+					   ttl);
+
+	/* Only the last of several snapshots would be visible. */
+	if (topic->snapshot) {
+		err = topic_publish_snap(topic,
+					 src + (count - 1) * topic->msg_size,
+					 user);
+		return err ? err : count;
+	}
+
+	chunk = max_t(size_t, MAX_LOCKED_COPY / topic->msg_size, 1);
+
+	do {
+		n = topic_publish_chunk(topic, src + done * topic->msg_size,
+					min(count - done, chunk), user,
+					nonblock || done, ttl);
+		if (n < 0)
+			break;
+		done += n;
+	} while (n == chunk && done < count);
+
+	return done ? done : n;
+}
+
+/* Return whether a held message is due before another. */
+static bool delayed_before(const struct kpub_delayed *a,
+			   const struct kpub_delayed *b)
+{
+	return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+/* Move the held message at position i up to its place in the heap. */
+static size_t delay_sift_up(struct kpub_delayed **heap, size_t i)
+{
+	size_t parent;
+
+	for (; i && delayed_before(heap[i], heap[parent = (i - 1) / 2]);
+	     i = parent)
+		swap(heap[i], heap[parent]);
+
+	return i;
+}
+
+/* Restore the min-heap order of n held messages below position i. */
+static void delay_sift_down(struct kpub_delayed **heap, size_t n, size_t i)
+{
+	size_t child;
+
+	for (; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && delayed_before(heap[child + 1], heap[child]))
+			++child;
+		if (!delayed_before(heap[child], heap[i]))
+			break;
+		swap(heap[i], heap[child]);
+	}
+}
+
+/*
+ * Hold a message until it is due, arming the timer if it is due before any
+ * other. The heap grows outside the lock, so the room is rechecked after.
+ * Held messages live outside the ring, so at most a ring's worth of bytes is
+ * held at once.
+ */
+static int topic_delay_push(struct topic *topic, struct kpub_delayed *d)
+{
+	struct kpub_delayed **heap, **old = NULL;
+	unsigned long flags;
+	size_t cap;
+	int err = 0;
+
+	spin_lock_irqsave(&topic->delay_lock, flags);
+
+	while (topic->ndelayed == topic->delay_cap &&
+	       topic->ndelayed < MAX_DELAYED) {
+		cap = clamp_t(size_t, 2 * topic->delay_cap, 64, MAX_DELAYED);
+		spin_unlock_irqrestore(&topic->delay_lock, flags);
+
+		kvfree(old);
+		heap = kvmalloc_array(cap, sizeof(*heap), GFP_KERNEL);
+		if (!heap)
+			return -ENOMEM;
+
+		spin_lock_irqsave(&topic->delay_lock, flags);
+		old = heap;
+		if (cap > topic->delay_cap) {
+			memcpy(heap, topic->delayed,
+			       topic->ndelayed * sizeof(*heap));
+			old = topic->delayed;
+			topic->delayed = heap;
+			topic->delay_cap = cap;
+		}
+	}
+
+	if (topic->ndelayed == MAX_DELAYED ||
+	    topic->delay_bytes + topic->msg_size >
+		    topic->msg_count * topic->msg_stride) {
+		err = -ENOSPC;
+		goto cleanup;
+	}
+
+	topic->delay_bytes += topic->msg_size;
+	d->seq = topic->delay_seq++;
+	topic->delayed[topic->ndelayed] = d;
+	WRITE_ONCE(topic->ndelayed, topic->ndelayed + 1);
+	if (delay_sift_up(topic->delayed, topic->ndelayed - 1) == 0)
+		hrtimer_start(&topic->delay_timer, ns_to_ktime(d->at),
+			      HRTIMER_MODE_ABS_SOFT);
+
+cleanup:
+	spin_unlock_irqrestore(&topic->delay_lock, flags);
+	kvfree(old);
+
+	return err;
+}
+
+/*
+ * Hold count messages from a writer until at. Partitioned topics route each
+ * message now, so it is held by the partition it will be published to.
+ * Returns the number of messages held.
+ */
+static ssize_t topic_defer(struct topic *topic, const char __user *src,
+			   size_t count, u64 ttl, u64 at)
+{
+	struct kpub_delayed *d;
+	size_t i, part = 0;
+	struct topic *dst;
+	int err = 0;
+
+	if (topic->snapshot) {
+		dev_err(&topic->dev, "snapshot writes cannot be delayed\n");
+		return -EINVAL;
+	}
+
+	if (topic->nparts && (topic->lanes || !topic->key_len))
+		part = topic->lanes ? 0 :
+				      (u32)atomic_inc_return(&topic->rr) %
+					      topic->nparts;
+
+	for (i = 0; i < count; ++i) {
+		d = kmalloc(struct_size(d, msg, topic->msg_size), GFP_KERNEL);
+		if (!d) {
+			err = -ENOMEM;
+			break;
+		}
+
+		d->at = at;
+		d->ttl = ttl;
+		if (copy_from_user(d->msg, src + i * topic->msg_size,
+				   topic->msg_size))
+			err = -EFAULT;
+		else if (topic->nparts && topic->key_len && !topic->lanes)
+			err = topic_route(topic, d->msg, false, &part);
+
+		dst = topic->nparts ? topic->parts[part] : topic;
+		if (!err && dst->msg_size != topic->msg_size)
+			err = -EINVAL;
+		if (!err)
+			err = topic_delay_push(dst, d);
+		if (err) {
+			kfree(d);
+			break;
+		}
+	}
+
+	return i ? i : err;
+}
+
+/*
+ * Publish the held messages that are due and rearm for the next one. If the
+ * ring is full, due messages stay held and are retried shortly after, ahead
+ * of any that fall due later.
+ */
+static enum hrtimer_restart topic_delay_fire(struct hrtimer *timer)
+{
+	struct topic *topic = container_of(timer, struct topic, delay_timer);
+	struct kpub_delayed *d;
+	unsigned long flags;
+	u64 now, next = 0;
+	size_t n = 0, copied = 0;
+
+	spin_lock_irqsave(&topic->delay_lock, flags);
+	spin_lock(&topic->lock);
+
+	now = ktime_get_ns();
+	while (topic->ndelayed && (d = topic->delayed[0])->at <= now) {
+		/*
+		 * Interrupts are off, so copy at most MAX_LOCKED_COPY bytes and
+		 * leave the rest for the timer to deliver straight away.
+		 */
+		if (copied >= MAX_LOCKED_COPY) {
+			next = now;
+			break;
+		}
+
+		/* The buffer cannot go while messages are held, but check. */
+		if (!topic->buf) {
+			++topic->dropped;
+		} else if (topic_claim(topic, 1) == 0) {
+			next = now + DELAY_RETRY_NS;
+			break;
+		} else {
+			memcpy(topic_slot(topic, topic->wp), d->msg,
+			       topic->msg_size);
+			topic_commit(topic, 1, d->ttl);
+			copied += topic->msg_size;
+			++n;
+		}
+
+		WRITE_ONCE(topic->ndelayed, topic->ndelayed - 1);
+		topic->delay_bytes -= topic->msg_size;
+		topic->delayed[0] = topic->delayed[topic->ndelayed];
+		delay_sift_down(topic->delayed, topic->ndelayed, 0);
+		kfree(d);
+	}
+
+	spin_unlock(&topic->lock);
+
+	/*
+	 * A writer may have rearmed the timer while this ran, so restart it
+	 * rather than setting the expiry of a queued timer.
+	 */
+	if (!next && topic->ndelayed)
+		next = topic->delayed[0]->at;
+	if (next)
+		hrtimer_start(timer, ns_to_ktime(next), HRTIMER_MODE_ABS_SOFT);
+
+	spin_unlock_irqrestore(&topic->delay_lock, flags);
+
+	if (n)
+		topic_wake_readers(topic);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Take tokens for up to n messages of unit tokens each. The bucket holds one
+ * second's worth, or one message if that is more. Returns how many messages
+ * the limit allows now and, if none, sets wait to how long until one.
+ */
+static u64 limit_take(struct kpub_limit *l, u64 unit, u64 n, u64 now,
+		      u64 *wait)
+{
+	u64 rate = READ_ONCE(l->rate), cost, burst, start, room, take;
+	s64 old, tat;
+
+	if (!rate)
+		return n;
+
+	cost = mul_u64_u64_div_u64(unit, NSEC_PER_SEC, rate);
+	burst = max_t(u64, NSEC_PER_SEC, cost);
+
+	old = atomic64_read(&l->tat);
+	do {
+		start = max_t(u64, old, now);
+
+		/*
+		 * Tokens may have been taken past the burst, before the rate or
+		 * burst was lowered or by an overlapping limit.
+		 */
+		if (start >= now + burst) {
+			*wait = start - now - burst + cost;
+			return 0;
+		}
+
+		room = now + burst - start;
+		take = min(n, div64_u64(mul_u64_u64_div_u64(room, rate,
+							    NSEC_PER_SEC),
+					unit));
+		if (!take) {
+			*wait = cost > room ? cost - room : 1;
+			return 0;
+		}
+		tat = start + mul_u64_u64_div_u64(take * unit, NSEC_PER_SEC,
+						  rate);
+	} while (!atomic64_try_cmpxchg(&l->tat, &old, tat));
+
+	return take;
+}
+
+/* Give back tokens taken for n messages that were not published. */
+static void limit_refund(struct kpub_limit *l, u64 unit, u64 n)
+{
+	u64 rate = READ_ONCE(l->rate);
+
+	if (n && rate)
+		atomic64_sub(mul_u64_u64_div_u64(n * unit, NSEC_PER_SEC, rate),
+			     &l->tat);
+}
+
+static void limits_refund(struct kpub_limits *lim, size_t size, u64 n)
+{
+	limit_refund(&lim->msgs, 1, n);
+	limit_refund(&lim->bytes, size, n);
+}
+
+/* Return whether either of a set's limits is on. */
+static inline bool limits_active(struct kpub_limits *lim)
+{
+	return READ_ONCE(lim->msgs.rate) || READ_ONCE(lim->bytes.rate);
+}
+
+/* Take tokens for up to n messages from both of a set's limits. */
+static u64 limits_take(struct kpub_limits *lim, size_t size, u64 n, u64 now,
+		       u64 *wait)
+{
+	u64 msgs, bytes;
+
+	msgs = limit_take(&lim->msgs, 1, n, now, wait);
+	if (!msgs)
+		return 0;
+
+	bytes = limit_take(&lim->bytes, size, msgs, now, wait);
+	limit_refund(&lim->msgs, 1, msgs - bytes);
+
+	return bytes;
+}
+
+/*
+ * Hold a writer to the topic's rate limits, its own, and those of the lane
+ * dst it publishes to, if any. Returns how many of count messages it may
+ * publish, sleeping until that is at least one unless the limit in the way
+ * rejects or the file is non-blocking.
+ */
+static ssize_t writer_throttle(struct kpub_file *kf, struct topic *dst,
+			       size_t count, bool nonblock)
+{
+	struct topic *topic = kf->topic;
+	struct kpub_limits *lims[] = { &topic->limits, &kf->limits,
+				       &dst->limits };
+	size_t size = topic->msg_size, nlims = dst != topic ? 3 : 2, i, j;
+	bool active = false, counted = false;
+	struct kpub_limits *lim;
+	u64 n, m, now, wait;
+
+	if (!count)
+		return 0;
+
+	for (i = 0; i < nlims; ++i)
+		active |= limits_active(lims[i]);
+	if (!active)
+		return count;
+
+	for (;;) {
+		now = ktime_get_mono_fast_ns();
+
+		for (i = 0, n = count; i < nlims && n; ++i) {
+			m = limits_take(lims[i], size, n, now, &wait);
+			for (j = 0; j < i; ++j)
+				limits_refund(lims[j], size, n - m);
+			n = m;
+		}
+		if (n)
+			return n;
+
+		lim = lims[i - 1];
+		if (!counted) {
+			atomic_long_inc(&topic->throttled);
+			if (dst != topic && lim == &dst->limits)
+				atomic_long_inc(&dst->throttled);
+			counted = true;
+		}
+
+		if (nonblock || READ_ONCE(lim->reject))
+			return -EAGAIN;
+
+		schedule_timeout_interruptible(
+			max_t(unsigned long, nsecs_to_jiffies(wait), 1));
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
+}
+
+/* Give back the tokens writer_throttle took for n messages not published. */
+static void writer_refund(struct kpub_file *kf, struct topic *dst, u64 n)
+{
+	struct topic *topic = kf->topic;
+
+	limits_refund(&topic->limits, topic->msg_size, n);
+	limits_refund(&kf->limits, topic->msg_size, n);
+	if (dst != topic)
+		limits_refund(&dst->limits, topic->msg_size, n);
+}
+
+/* Set a writer's own rate limits. */
+static int writer_set_rate(struct kpub_file *kf, const void __user *uarg)
+{
+	struct kpub_rate rate;
+
+	if (copy_from_user(&rate, uarg, sizeof(rate)))
+		return -EFAULT;
+
+	WRITE_ONCE(kf->limits.msgs.rate, min_t(u64, rate.msgs, MAX_RATE));
+	WRITE_ONCE(kf->limits.bytes.rate, min_t(u64, rate.bytes, MAX_RATE));
+	WRITE_ONCE(kf->limits.reject, !!rate.reject);
+
+	return 0;
+}
+
+static ssize_t kpub_write(struct file *file, const char __user *buf, size_t len,
+			  loff_t *off)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	ssize_t n, allowed;
+	struct topic *dst;
+	u64 at;
+
+	if (len == 0)
+		return 0;
+
+	if (topic->snapshot && len != topic->msg_size) {
+		dev_err(&topic->dev, "snapshot writes must be msg_size bytes\n");
+		return -EINVAL;
+	}
+
+	if (len % topic->msg_size) {
+		dev_err(&topic->dev,
+			"write length must be a multiple of msg_size\n");
+		return -EINVAL;
+	}
+
+	if (!topic->snapshot && len / topic->msg_size > topic->msg_count) {
+		dev_err(&topic->dev,
+			"cannot write more than msg_count messages\n");
+		return -EINVAL;
+	}
+
+	dst = topic->lanes ? topic->parts[READ_ONCE(kf->lane)] : topic;
+	if (dst->msg_size != topic->msg_size)
+		return -EINVAL;
+
+	allowed = writer_throttle(kf, dst, len / topic->msg_size,
+				  file->f_flags & O_NONBLOCK);
+	if (allowed < 0)
+		return allowed;
+
+	at = READ_ONCE(kf->deliver_at);
+
+	if (at && at > ktime_get_ns())
+		n = topic_defer(dst, buf, allowed, READ_ONCE(kf->ttl_ns), at);
+	else
+		n = topic_publish(dst, (const void __force *)buf, allowed, true,
+				  file->f_flags & O_NONBLOCK,
+				  READ_ONCE(kf->ttl_ns));
+
+	if (n < allowed)
+		writer_refund(kf, dst, allowed - max_t(ssize_t, n, 0));
+
+	if (n < 0)
+		return n;
+
+	return n * topic->msg_size;
+}
+
+static unsigned kpub_poll(struct file *file, poll_table *ppt)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	struct topic *part;
+	int ready_mask = 0;
+	size_t i;
+
+	if (file->f_mode & FMODE_READ && kf->group) {
+		poll_wait(file, &kf->group->wq, ppt);
+		if (group_pending(kf->group))
+			ready_mask |= POLLIN | POLLRDNORM;
+	} else if (kf->lanes) {
+		poll_wait(file, &topic->inq, ppt);
+		if (lanes_pending(kf))
+			ready_mask |= POLLIN | POLLRDNORM;
+	} else if (file->f_mode & FMODE_READ) {
+		poll_wait(file, &topic->inq, ppt);
+		mutex_lock(&kf->mtx);
+		if (READ_ONCE(kf->lagged))
+			ready_mask |= POLLERR;
+		if (topic->snapshot ? READ_ONCE(topic->snap_gen) != kf->gen :
+				      reader_pending(kf))
+			ready_mask |= (POLLIN | POLLRDNORM);
+		mutex_unlock(&kf->mtx);
+	} else if (topic->snapshot) {
+		/* Snapshot writers never wait. */
+		ready_mask |= POLLOUT | POLLWRNORM;
+	} else if (topic->lanes) {
+		/* Writers publish to the lane they picked. */
+		part = topic->parts[READ_ONCE(kf->lane)];
+		poll_wait(file, &part->outq, ppt);
+		if (!READ_ONCE(part->nqueued) && topic_writable(part))
+			ready_mask |= POLLOUT | POLLWRNORM;
+	} else if (topic->nparts) {
+		/*
+		 * Writers publish to the partitions, which cannot change while
+		 * the topic is open.
+		 */
+		for (i = 0; i < topic->nparts; ++i) {
+			part = topic->parts[i];
+			poll_wait(file, &part->outq, ppt);
+			if (!READ_ONCE(part->nqueued) && topic_writable(part))
+				ready_mask |= POLLOUT | POLLWRNORM;
+		}
+	} else {
+		poll_wait(file, &topic->outq, ppt);
+		if (!READ_ONCE(topic->nqueued) && topic_writable(topic))
+			ready_mask |= POLLOUT | POLLWRNORM;
+	}
+
+	return ready_mask;
+}
+
+/*
+ * Prepare a classic BPF filter to run directly on a message, the way seccomp
+ * runs filters on struct seccomp_data. 32-bit absolute loads are rewritten to
+ * read from the message; loads that assume a socket buffer are rejected.
+ * Offsets are bounds-checked against msg_size by reader_set_filter.
+ */
+static int kpub_filter_trans(struct sock_filter *filter, unsigned int flen)
+{
+	struct sock_filter *ftest;
+	int pc;
+
+	for (pc = 0; pc < flen; ++pc) {
+		ftest = &filter[pc];
+
+		switch (ftest->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+			if (ftest->k & 3)
+				return -EINVAL;
+			ftest->code = BPF_LDX | BPF_W | BPF_ABS;
+			continue;
+		case BPF_RET | BPF_K:
+		case BPF_RET | BPF_A:
+		case BPF_ALU | BPF_ADD | BPF_K:
+		case BPF_ALU | BPF_ADD | BPF_X:
+		case BPF_ALU | BPF_SUB | BPF_K:
+		case BPF_ALU | BPF_SUB | BPF_X:
+		case BPF_ALU | BPF_MUL | BPF_K:
+		case BPF_ALU | BPF_MUL | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_K:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU | BPF_AND | BPF_K:
+		case BPF_ALU | BPF_AND | BPF_X:
+		case BPF_ALU | BPF_OR | BPF_K:
+		case BPF_ALU | BPF_OR | BPF_X:
+		case BPF_ALU | BPF_XOR | BPF_K:
+		case BPF_ALU | BPF_XOR | BPF_X:
+		case BPF_ALU | BPF_LSH | BPF_K:
+		case BPF_ALU | BPF_LSH | BPF_X:
+		case BPF_ALU | BPF_RSH | BPF_K:
+		case BPF_ALU | BPF_RSH | BPF_X:
+		case BPF_ALU | BPF_NEG:
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_IMM:
+		case BPF_MISC | BPF_TAX:
+		case BPF_MISC | BPF_TXA:
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+		case BPF_JMP | BPF_JA:
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			continue;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Attach a classic BPF filter to a reader. Messages the filter returns zero
+ * for are skipped before they are copied. The original program is kept so
+ * load offsets can be checked against msg_size, which the rewrite pass does
+ * not know.
+ */
+static int reader_set_filter(struct kpub_file *kf,
+			     struct sock_fprog __user *ufprog)
+{
+	size_t msg_size = kf->topic->msg_size;
+	struct sock_fprog fprog;
+	struct sock_filter *insn;
+	struct bpf_prog *prog;
+	int err, pc;
+
+	if (copy_from_user(&fprog, ufprog, sizeof(fprog)))
+		return -EFAULT;
+
+	err = bpf_prog_create_from_user(&prog, &fprog, kpub_filter_trans, true);
+	if (err)
+		return err;
+
+	for (pc = 0; pc < prog->orig_prog->len; ++pc) {
+		insn = &prog->orig_prog->filter[pc];
+		if (insn->code == (BPF_LD | BPF_W | BPF_ABS) &&
+		    (msg_size < sizeof(u32) || insn->k > msg_size - sizeof(u32))) {
+			bpf_prog_destroy(prog);
+			return -EINVAL;
+		}
+	}
+
+	if (mutex_lock_interruptible(&kf->mtx)) {
+		bpf_prog_destroy(prog);
+		return -ERESTARTSYS;
+	}
+
+	prog = rcu_replace_pointer(kf->filter, prog, lockdep_is_held(&kf->mtx));
+
+	mutex_unlock(&kf->mtx);
+
+	if (prog) {
+		synchronize_rcu();
+		bpf_prog_destroy(prog);
+	}
+
+	return 0;
+}
+
+/* Detach a reader's filter so it receives every message again. */
+static int reader_clear_filter(struct kpub_file *kf)
+{
+	struct bpf_prog *prog;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	prog = rcu_replace_pointer(kf->filter, NULL, lockdep_is_held(&kf->mtx));
+
+	mutex_unlock(&kf->mtx);
+
+	if (prog) {
+		synchronize_rcu();
+		bpf_prog_destroy(prog);
+	}
+
+	return 0;
+}
+
+/*
+ * Replace a reader's content predicates. An empty set removes them. The
+ * predicates are grouped by comparison here so that preds_match runs one
+ * tight loop per group.
+ */
+static int reader_set_preds(struct kpub_file *kf,
+			    struct kpub_pred_set __user *uset)
+{
+	size_t msg_size = kf->topic->msg_size;
+	struct kpub_preds *preds = NULL;
+	struct kpub_pred_set set;
+	struct kpub_pred *upreds;
+	u32 i, op, n = 0;
+
+	if (copy_from_user(&set, uset, sizeof(set)))
+		return -EFAULT;
+
+	if (set.count > KPUB_MAX_PREDS || set.reserved)
+		return -EINVAL;
+
+	if (set.count) {
+		upreds = memdup_user(u64_to_user_ptr(set.preds),
+				     set.count * sizeof(*upreds));
+		if (IS_ERR(upreds))
+			return PTR_ERR(upreds);
+
+		for (i = 0; i < set.count; ++i) {
+			if (upreds[i].op >= KPUB_PRED_NR_OPS ||
+			    msg_size < sizeof(u64) ||
+			    upreds[i].offset > msg_size - sizeof(u64)) {
+				kfree(upreds);
+				return -EINVAL;
+			}
+		}
+
+		preds = kzalloc(sizeof(*preds), GFP_KERNEL);
+		if (!preds) {
+			kfree(upreds);
+			return -ENOMEM;
+		}
+
+		for (op = 0; op < KPUB_PRED_NR_OPS; ++op) {
+			for (i = 0; i < set.count; ++i) {
+				if (upreds[i].op != op)
+					continue;
+				preds->off[n] = upreds[i].offset;
+				preds->mask[n] = upreds[i].mask;
+				preds->value[n] = upreds[i].value;
+				++n;
+			}
+			preds->end[op] = n;
+		}
+
+		kfree(upreds);
+	}
+
+	if (mutex_lock_interruptible(&kf->mtx)) {
+		kfree(preds);
+		return -ERESTARTSYS;
+	}
+
+	preds = rcu_replace_pointer(kf->preds, preds, lockdep_is_held(&kf->mtx));
+
+	mutex_unlock(&kf->mtx);
+
+	if (preds)
+		kfree_rcu(preds, rcu);
+
+	return 0;
+}
+
+/* Choose whether reads return each message with its header. */
+static int reader_set_header(struct kpub_file *kf, u32 __user *uheader)
+{
+	u32 header;
+
+	if (get_user(header, uheader))
+		return -EFAULT;
+
+	if (header && !kf->topic->hdr_size)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+	kf->header = header;
+	mutex_unlock(&kf->mtx);
+
+	return 0;
+}
+
+/* Seek to the first message published at or after a CLOCK_MONOTONIC time. */
+static int reader_ioc_seek_time(struct file *file, u64 __user *uns)
+{
+	struct kpub_file *kf = file->private_data;
+	u64 ns, seq;
+
+	if (get_user(ns, uns))
+		return -EFAULT;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	seq = reader_seek_time(kf, ns);
+	file->f_pos = seq;
+
+	mutex_unlock(&kf->mtx);
+
+	return put_user(seq, uns);
+}
+
+/*
+ * Copy retained messages from a position without consuming them, for
+ * KPUB_IOC_PREAD. Returns the number of bytes copied.
+ */
+static long reader_ioc_pread(struct kpub_file *kf,
+			     const struct kpub_pread __user *uarg)
+{
+	struct topic *topic = kf->topic;
+	size_t hdr_size, rec, max;
+	struct kpub_pread req;
+	long ret;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+
+	if (topic->snapshot)
+		return -EINVAL;
+
+	hdr_size = kf->header ? topic->hdr_size : 0;
+	rec = hdr_size + topic->msg_size;
+	max = min_t(u64, req.len, MAX_RW_COUNT) / rec;
+	if (max == 0)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	ret = reader_pread(kf, u64_to_user_ptr(req.buf), max, rec, hdr_size,
+			   req.pos);
+
+	mutex_unlock(&kf->mtx);
+
+	return ret;
+}
+
+/*
+ * Join a named consumer group, reading through its shared cursor from then
+ * on until the file is closed. Per-file filters, seeking and durable cursors
+ * do not apply to group reads, so a reader using them cannot join.
+ */
+static int reader_join_group(struct kpub_file *kf, const char __user *uname)
+{
+	struct topic *topic = kf->topic;
+	char name[KPUB_NAME_LEN];
+	struct kpub_group *g;
+	int err = 0;
+	long len;
+
+	len = strncpy_from_user(name, uname, sizeof(name));
+	if (len < 0)
+		return len;
+	if (len == sizeof(name))
+		return -ENAMETOOLONG;
+	if (len == 0 || topic->snapshot)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	if (kf->group || kf->cursor || rcu_access_pointer(kf->filter) ||
+	    rcu_access_pointer(kf->preds)) {
+		err = -EBUSY;
+		goto cleanup;
+	}
+
+	mutex_lock(&topic->mtx);
+
+	g = topic_get_group(topic, name);
+	if (IS_ERR(g)) {
+		mutex_unlock(&topic->mtx);
+		err = PTR_ERR(g);
+		goto cleanup;
+	}
+
+	++g->nmembers;
+	kf->group = g;
+
+	/* The group's cursor holds the reader's place in the ring now. */
+	spin_lock_irq(&topic->lock);
+	list_del(&kf->entry);
+	spin_unlock_irq(&topic->lock);
+	wake_up_interruptible(&topic->outq);
+
+	mutex_unlock(&topic->mtx);
+
+cleanup:
+	mutex_unlock(&kf->mtx);
+	return err;
+}
+
+/*
+ * Attach a reader to a durable cursor, creating it at the reader's position
+ * or resuming from it. A committed position that has been overwritten
+ * resumes at the oldest retained message instead.
+ */
+static int reader_attach_cursor(struct file *file, const char __user *uname)
+{
+	struct kpub_file *kf = file->private_data;
+	struct topic *topic = kf->topic;
+	char name[KPUB_NAME_LEN];
+	struct kpub_cursor *c;
+	int err = 0;
+	long len;
+	u64 pos;
+
+	len = strncpy_from_user(name, uname, sizeof(name));
+	if (len < 0)
+		return len;
+	if (len == sizeof(name))
+		return -ENAMETOOLONG;
+	if (len == 0 || topic->snapshot || strchr(name, ' ') ||
+	    strchr(name, '\n'))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&kf->mtx))
+		return -ERESTARTSYS;
+
+	if (kf->group || kf->cursor) {
+		err = -EBUSY;
+		goto cleanup;
+	}
+
+	mutex_lock(&topic->mtx);
+
+	c = topic_find_cursor(topic, name);
+	if (c && c->reader) {
+		err = -EBUSY;
+		goto cleanup_topic;
+	}
+
+	if (!c) {
+		if (topic->ncursors == MAX_CURSORS) {
+			dev_err(&topic->dev, "maximum number of cursors (%d) reached\n",
+				MAX_CURSORS);
+			err = -ENOSPC;
+			goto cleanup_topic;
+		}
+
+		c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if (!c) {
+			err = -ENOMEM;
+			goto cleanup_topic;
+		}
+
+		strscpy(c->name, name, sizeof(c->name));
+		c->pos = kf->rp;
+		list_add_tail(&c->entry, &topic->cursors);
+		++topic->ncursors;
+	}
+
+	spin_lock_irq(&topic->lock);
+	pos = clamp(READ_ONCE(c->pos), topic_first(topic), topic->wp);
+	spin_unlock_irq(&topic->lock);
+
+	/* Slots may be reused between the clamp and the seek, so retry. */
+	while (reader_seek(kf, pos) == -ENXIO) {
+		spin_lock_irq(&topic->lock);
+		pos = max(pos, topic_first(topic));
+		spin_unlock_irq(&topic->lock);
+	}
+
+	c->reader = kf;
+	kf->cursor = c;
+	kf->start = pos;
+	file->f_pos = pos;
+
+cleanup_topic:
+	mutex_unlock(&topic->mtx);
+cleanup:
+	mutex_unlock(&kf->mtx);
+
+	return err;
+}
+
+/*
+ * Commit a position to the reader's durable cursor. It is only ever read
+ * back when a reader attaches, so committing is a single store.
+ */
+static int reader_commit(struct kpub_file *kf, const u64 __user *upos)
+{
+	u64 pos;
 
-struct topic {
-	size_t msg_size, msg_count;
-	size_t nreaders, nwriters;
-	size_t wp, rp, len, rcount;
-	char *buf;
-	char name[MAX_STR_LEN];
-	struct device dev;
-	struct cdev cdev;
-	struct list_head entry;
-	struct mutex mtx;
-	wait_queue_head_t inq, outq;
-};
+	if (get_user(pos, upos))
+		return -EFAULT;
 
-#define cdev_to_topic(ptr) container_of(ptr, struct topic, cdev);
-#define dev_to_topic(ptr) container_of(ptr, struct topic, dev);
-#define node_to_topic(ptr) list_entry(ptr, struct topic, entry);
+	if (!kf->cursor || pos > READ_ONCE(kf->rp))
+		return -EINVAL;
 
-/* Stores all topics. */
-LIST_HEAD(topics);
+	WRITE_ONCE(kf->cursor->pos, pos);
 
-/* Protects topic creation. */
-static DEFINE_MUTEX(topic_mtx);
+	return 0;
+}
 
-/* Represents the class under sysfs. */
-static struct class kpub_class;
+/* Acknowledge a batch of messages read through a consumer group. */
+static int reader_ack(struct kpub_file *kf, const void __user *uarg)
+{
+	struct kpub_group *g = kf->group;
+	struct kpub_acks acks;
+	const u64 __user *useqs;
+	u64 seqs[32];
+	int err = 0;
+	size_t n;
 
-/* Defines file operations for each topic. */
-static struct file_operations kpub_fops;
+	if (!g || !g->leases)
+		return -EINVAL;
 
-/* Contains the module's major and minor numbers. */
-static dev_t kpub_devt;
+	if (copy_from_user(&acks, uarg, sizeof(acks)))
+		return -EFAULT;
+	useqs = u64_to_user_ptr(acks.seqs);
 
-/* Major number assigned by the kernel. */
-static int major_num;
+	if (mutex_lock_interruptible(&g->kf.mtx))
+		return -ERESTARTSYS;
 
-/* Tracks minor numbers in use. */
-static uint8_t minor_nums[NUM_TOPICS];
+	while (!err && acks.count) {
+		n = min_t(size_t, acks.count, ARRAY_SIZE(seqs));
+		if (copy_from_user(seqs, useqs, n * sizeof(*seqs))) {
+			err = -EFAULT;
+			break;
+		}
+		err = group_ack(g, kf, seqs, n);
+		useqs += n;
+		acks.count -= n;
+	}
 
-/* Read the topic name. */
-static ssize_t name_show(struct device *dev, struct device_attribute *attr,
-			 char *buf)
-{
-	struct topic *topic = dev_to_topic(dev);
-	size_t len = strlen(topic->name);
-	memcpy(buf, topic->name, len);
-	return len;
+	group_settle(g);
+
+	mutex_unlock(&g->kf.mtx);
+
+	return err;
 }
 
-/* Read the topic message size. */
-static ssize_t msg_size_show(struct device *dev, struct device_attribute *attr,
-			     char *buf)
+/* Set the time to live of the messages a writer publishes. */
+static int writer_set_ttl(struct kpub_file *kf, const u64 __user *uttl)
 {
-	struct topic *topic = dev_to_topic(dev);
-	return snprintf(buf, MAX_STR_LEN, "%lu", topic->msg_size);
+	u64 us;
+
+	if (get_user(us, uttl))
+		return -EFAULT;
+
+	if (us > U64_MAX / NSEC_PER_USEC)
+		return -EINVAL;
+
+	WRITE_ONCE(kf->ttl_ns, us * NSEC_PER_USEC);
+
+	return 0;
 }
 
-/* Store the topic message size. */
-static ssize_t msg_size_store(struct device *dev, struct device_attribute *attr,
-			      const char *buf, size_t len)
+/* Set when the messages a writer publishes are delivered. */
+static int writer_deliver_at(struct kpub_file *kf, const u64 __user *uat)
 {
-	struct topic *topic = dev_to_topic(dev);
-	int err;
+	u64 at;
 
-	if (mutex_lock_interruptible(&topic->mtx))
-		return -ERESTARTSYS;
+	if (get_user(at, uat))
+		return -EFAULT;
 
-	if (topic->nreaders || topic->nwriters) {
-		dev_err(&topic->dev,
-			"cannot modify buffers with open file descriptors\n");
-		len = -EINVAL;
-		goto cleanup;
-	}
+	WRITE_ONCE(kf->deliver_at, at);
 
-	err = kstrtoul(buf, 10, &topic->msg_size);
-	if (err < 0) {
-		len = err;
-		goto cleanup;
-	}
+	return 0;
+}
 
-	dev_info(&topic->dev, "message size set to %lu bytes\n",
-		 topic->msg_size);
+/* Pick the lane a writer publishes to. */
+static int writer_set_lane(struct kpub_file *kf, const u32 __user *ulane)
+{
+	u32 lane;
 
-cleanup:
-	mutex_unlock(&topic->mtx);
-	return len;
+	if (get_user(lane, ulane))
+		return -EFAULT;
+
+	if (!kf->topic->lanes || lane >= kf->topic->nparts)
+		return -EINVAL;
+
+	WRITE_ONCE(kf->lane, lane);
+
+	return 0;
 }
 
-/* Read the topic message count. */
-static ssize_t msg_count_show(struct device *dev, struct device_attribute *attr,
-			      char *buf)
+static long kpub_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-	struct topic *topic = dev_to_topic(dev);
-	return snprintf(buf, MAX_STR_LEN, "%lu", topic->msg_count);
+	struct kpub_file *kf = file->private_data;
+	void __user *uarg = (void __user *)arg;
+
+	/* Per-lane cursors only support plain reads, with or without headers. */
+	if (kf->lanes && cmd != KPUB_IOC_READ_HEADER)
+		return -EINVAL;
+
+	switch (cmd) {
+	case KPUB_IOC_SNAP_GEN:
+		return put_user(READ_ONCE(kf->topic->snap_gen), (u64 __user *)uarg);
+	case KPUB_IOC_SET_FILTER:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (kf->group)
+			return -EBUSY;
+		return reader_set_filter(kf, uarg);
+	case KPUB_IOC_CLEAR_FILTER:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_clear_filter(kf);
+	case KPUB_IOC_SET_PREDS:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (kf->group)
+			return -EBUSY;
+		return reader_set_preds(kf, uarg);
+	case KPUB_IOC_READ_HEADER:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_set_header(kf, uarg);
+	case KPUB_IOC_SEEK_TIME:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (kf->group)
+			return -EBUSY;
+		return reader_ioc_seek_time(file, uarg);
+	case KPUB_IOC_PREAD:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (kf->group)
+			return -EBUSY;
+		return reader_ioc_pread(kf, uarg);
+	case KPUB_IOC_JOIN_GROUP:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_join_group(kf, uarg);
+	case KPUB_IOC_ACK:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_ack(kf, uarg);
+	case KPUB_IOC_CURSOR:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_attach_cursor(file, uarg);
+	case KPUB_IOC_COMMIT:
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return reader_commit(kf, uarg);
+	case KPUB_IOC_SET_RATE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return writer_set_rate(kf, uarg);
+	case KPUB_IOC_SET_LANE:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return writer_set_lane(kf, uarg);
+	case KPUB_IOC_SET_TTL:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return writer_set_ttl(kf, uarg);
+	case KPUB_IOC_DELIVER_AT:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return writer_deliver_at(kf, uarg);
+	default:
+		return -ENOTTY;
+	}
 }
 
-/* Store the topic message count. */
-static ssize_t msg_count_store(struct device *dev,
-			       struct device_attribute *attr, const char *buf,
-			       size_t len)
+static struct file_operations kpub_fops = {
+	.owner = THIS_MODULE,
+	.open = kpub_open,
+	.release = kpub_release,
+	.llseek = kpub_llseek,
+	.read = kpub_read,
+	.write = kpub_write,
+	.poll = kpub_poll,
+	.unlocked_ioctl = kpub_ioctl,
+};
+
+/*
+ * Copy the pending messages of one set member as tagged records, requeueing
+ * it if some are left. Returns the bytes copied, or an error if none were and
+ * the next record does not fit.
+ */
+static ssize_t member_read(struct kpub_member *m, char __user *buf, size_t len)
 {
-	struct topic *topic = dev_to_topic(dev);
-	int err;
+	struct kpub_file *kf = &m->kf;
+	struct topic *topic = kf->topic;
+	struct kpub_tag tag;
+	size_t rec, n = 0;
+	ssize_t err = 0;
+	u64 rp, wp;
+	char *msg;
 
-	if (mutex_lock_interruptible(&topic->mtx))
-		return -ERESTARTSYS;
+	mutex_lock(&kf->mtx);
 
-	if (topic->nreaders || topic->nwriters) {
-		dev_err(&topic->dev,
-			"cannot modify buffers with open file descriptors\n");
-		len = -EINVAL;
-		goto cleanup;
+	if (!reader_pending(kf))
+		goto out;
+
+	tag.topic_id = topic->dev.id;
+	tag.size = topic->msg_size;
+	rec = sizeof(tag) + ALIGN(topic->msg_size, 8);
+
+	if (len < rec) {
+		err = -EINVAL;
+		goto out;
 	}
 
-	err = kstrtoul(buf, 10, &topic->msg_count);
-	if (err < 0) {
-		len = err;
-		goto cleanup;
+	wp = smp_load_acquire(&topic->wp);
+	for (rp = kf->rp; rp != wp && n + rec <= len; ++rp) {
+		if (!reader_accept(kf, rp))
+			continue;
+		msg = topic_slot(topic, rp);
+		tag.seq = topic_stamp(topic, rp)->seq;
+		if (copy_to_user(buf + n, &tag, sizeof(tag)) ||
+		    copy_to_user(buf + n + sizeof(tag), msg, topic->msg_size)) {
+			err = -EFAULT;
+			break;
+		}
+		n += rec;
 	}
 
-	dev_info(&topic->dev, "message count set to %lu\n", topic->msg_count);
+	reader_advance(kf, rp);
 
-cleanup:
-	mutex_unlock(&topic->mtx);
-	return len;
+out:
+	/* A publish after the member left the ready list requeues it too. */
+	if (reader_pending(kf))
+		member_ready(m);
+
+	mutex_unlock(&kf->mtx);
+
+	return n ? n : err;
 }
 
-DEVICE_ATTR_RO(name);
-DEVICE_ATTR(msg_size, 0644, msg_size_show, msg_size_store);
-DEVICE_ATTR(msg_count, 0644, msg_count_show, msg_count_store);
-static struct attribute *topic_attrs[] = {
-	&dev_attr_name.attr,
-	&dev_attr_msg_size.attr,
-	&dev_attr_msg_count.attr,
-	NULL,
-};
-ATTRIBUTE_GROUPS(topic);
+/* Take the next member with messages waiting off a set's ready list. */
+static struct kpub_member *set_next_ready(struct kpub_set *set)
+{
+	struct kpub_member *m;
 
-/* Reserve and return the first available minor number. */
-static int reserve_minor_num(void)
+	spin_lock_irq(&set->lock);
+	m = list_first_entry_or_null(&set->ready, struct kpub_member, ready);
+	if (m)
+		list_del_init(&m->ready);
+	spin_unlock_irq(&set->lock);
+
+	return m;
+}
+
+/* Return whether a set may have messages waiting. */
+static bool set_ready(struct kpub_set *set)
 {
-	int i;
+	return !list_empty_careful(&set->ready);
+}
 
-	for (i = 0; i < NUM_TOPICS; ++i) {
-		if (!minor_nums[i]) {
-			minor_nums[i] = 1;
-			return i;
-		}
+static int set_open(struct inode *inode, struct file *file)
+{
+	struct kpub_set *set;
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (!set)
+		return -ENOMEM;
+
+	mutex_init(&set->mtx);
+	INIT_LIST_HEAD(&set->members);
+	INIT_LIST_HEAD(&set->patterns);
+	spin_lock_init(&set->lock);
+	INIT_LIST_HEAD(&set->ready);
+	init_waitqueue_head(&set->wq);
+
+	file->private_data = set;
+
+	return 0;
+}
+
+static int set_release(struct inode *inode, struct file *file)
+{
+	struct kpub_set *set = file->private_data;
+	struct kpub_pattern *p, *ptmp;
+	struct kpub_member *m, *mtmp;
+
+	mutex_lock(&topic_mtx);
+	list_for_each_entry_safe(p, ptmp, &set->patterns, set_entry) {
+		list_del(&p->node_entry);
+		trie_prune(p->node);
+		kfree(p);
 	}
+	mutex_unlock(&topic_mtx);
 
-	return -1;
+	mutex_lock(&set->mtx);
+	list_for_each_entry_safe(m, mtmp, &set->members, entry)
+		member_detach(m);
+	mutex_unlock(&set->mtx);
+
+	kfree(set);
+
+	return 0;
 }
 
-/* Mark the given minor number as available. */
-static void release_minor_num(int minor_num)
+/*
+ * Copy tagged records from the set's ready topics. Only members with messages
+ * waiting are visited, and a member that still has some after its turn goes
+ * to the back of the ready list, so a busy topic cannot starve the others.
+ */
+static ssize_t set_read_ready(struct kpub_set *set, char __user *buf,
+			      size_t len)
 {
-	minor_nums[minor_num] = 0;
+	struct kpub_member *m;
+	ssize_t n = 0, ret = 0;
+
+	while (ret >= 0 && n < len && (m = set_next_ready(set))) {
+		ret = member_read(m, buf + n, len - n);
+		if (ret > 0)
+			n += ret;
+	}
+
+	return n ? n : ret;
 }
 
-/* Release the topic's embedded device. */
-static void device_release(struct device *dev)
+/* Return the global sequence number of a member's next merged message. */
+static inline u64 member_key(struct kpub_member *m)
 {
-	// No need to release stack bound devices, but Linux expects one to be defined.
+	return topic_stamp(m->kf.topic, m->pos)->seq;
 }
 
-/* Create a new topic by writing its name to the class attribute. */
-static ssize_t create_topic_store(const struct class *cp,
-				  const struct class_attribute *attr,
-				  const char *buf, size_t len)
+/* Move a member to its next accepted message, if there is one. */
+static bool member_seek(struct kpub_member *m)
 {
-	int devt, err, minor_num;
-	struct topic *topic;
+	while (m->pos != m->end && !reader_accept(&m->kf, m->pos))
+		++m->pos;
 
-	if (len == 0) {
-		pr_alert("%s: topic cannot have an empty name\n",
-			 THIS_MODULE->name);
-		return -EINVAL;
-	}
+	return m->pos != m->end;
+}
 
-	if (len > MAX_STR_LEN) {
-		pr_alert("%s: topic too long, max %d bytes\n",
-			 THIS_MODULE->name, MAX_STR_LEN);
-		return -EINVAL;
+/* Restore the min-heap order of members below position i. */
+static void merge_sift(struct kpub_member **heap, size_t k, size_t i)
+{
+	size_t child;
+
+	for (; (child = 2 * i + 1) < k; i = child) {
+		if (child + 1 < k &&
+		    member_key(heap[child + 1]) < member_key(heap[child]))
+			++child;
+		if (member_key(heap[i]) <= member_key(heap[child]))
+			break;
+		swap(heap[i], heap[child]);
 	}
+}
 
-	if (mutex_lock_interruptible(&topic_mtx))
-		return -ERESTARTSYS;
+/*
+ * Copy tagged records from every ready topic in global publish order, using a
+ * heap of the members keyed by the sequence number of their next message.
+ * Messages published on other topics while the read runs may carry earlier
+ * sequence numbers than some it returns; they come first in the next read.
+ */
+static ssize_t set_read_merged(struct kpub_set *set, char __user *buf,
+			       size_t len)
+{
+	struct kpub_member **taken, **heap, *m;
+	size_t i, t = 0, k = 0, n = 0, rec;
+	struct kpub_tag tag;
+	struct topic *topic;
+	ssize_t err = 0;
 
-	topic = (struct topic *)kzalloc(sizeof(*topic), GFP_KERNEL);
-	if (!topic)
+	taken = kmalloc_array(2 * set->nmembers, sizeof(*taken), GFP_KERNEL);
+	if (!taken)
 		return -ENOMEM;
+	heap = taken + set->nmembers;
 
-	memcpy(topic->name, buf, len);
-
-	mutex_init(&topic->mtx);
-	init_waitqueue_head(&topic->inq);
-	init_waitqueue_head(&topic->outq);
+	/* Members with messages waiting are all on the ready list. */
+	while ((m = set_next_ready(set))) {
+		mutex_lock(&m->kf.mtx);
+		m->pos = m->kf.rp;
+		m->end = smp_load_acquire(&m->kf.topic->wp);
+		mutex_unlock(&m->kf.mtx);
 
-	minor_num = reserve_minor_num();
-	if (minor_num < 0) {
-		pr_alert("%s: maximum number of topics (%d) reached\n",
-			 THIS_MODULE->name, NUM_TOPICS);
-		err = -E2BIG;
-		goto cleanup_topic;
+		taken[t++] = m;
+		if (member_seek(m))
+			heap[k++] = m;
 	}
 
-	devt = MKDEV(major_num, minor_num);
+	for (i = k / 2; i-- > 0;)
+		merge_sift(heap, k, i);
 
-	cdev_init(&topic->cdev, &kpub_fops);
-	topic->cdev.owner = THIS_MODULE;
+	while (k) {
+		m = heap[0];
+		topic = m->kf.topic;
+		rec = sizeof(tag) + ALIGN(topic->msg_size, 8);
 
-	err = cdev_add(&topic->cdev, devt, 1);
-	if (err < 0) {
-		pr_alert("%s: could not add character device\n",
-			 THIS_MODULE->name);
-		goto cleanup_cdev;
+		if (n + rec > len) {
+			if (!n)
+				err = -EINVAL;
+			break;
+		}
+
+		tag.topic_id = topic->dev.id;
+		tag.size = topic->msg_size;
+		tag.seq = member_key(m);
+
+		if (copy_to_user(buf + n, &tag, sizeof(tag)) ||
+		    copy_to_user(buf + n + sizeof(tag),
+				 topic_slot(topic, m->pos), topic->msg_size)) {
+			err = -EFAULT;
+			break;
+		}
+
+		n += rec;
+		++m->pos;
+
+		if (!member_seek(m))
+			heap[0] = heap[--k];
+		merge_sift(heap, k, 0);
 	}
 
-	err = kobject_set_name(&topic->dev.kobj, "kpub!%s", topic->name);
-	if (err < 0) {
-		pr_alert("%s: could not set topic '%s' name\n",
-			 THIS_MODULE->name, topic->name);
-		goto cleanup_cdev;
+	for (i = 0; i < t; ++i) {
+		m = taken[i];
+		mutex_lock(&m->kf.mtx);
+		reader_advance(&m->kf, m->pos);
+		if (reader_pending(&m->kf))
+			member_ready(m);
+		mutex_unlock(&m->kf.mtx);
 	}
 
-	topic->dev.class = &kpub_class;
-	topic->dev.release = device_release;
-	topic->dev.devt = devt;
-	topic->dev.id = minor_num;
+	kfree(taken);
 
-	err = device_register(&topic->dev);
-	if (err) {
-		pr_alert("%s: could not add device '%s'\n", THIS_MODULE->name,
-			 topic->name);
-		goto cleanup_cdev;
-	}
+	return n ? n : err;
+}
 
-	list_add(&topic->entry, &topics);
+/*
+ * Read tagged records from the set's topics, either fairly across topics or,
+ * once KPUB_IOC_SET_MERGE is set, in global publish order.
+ */
+static ssize_t set_read(struct file *file, char __user *buf, size_t len,
+			loff_t *off)
+{
+	struct kpub_set *set = file->private_data;
+	ssize_t ret;
 
-	mutex_unlock(&topic_mtx);
+	if (mutex_lock_interruptible(&set->mtx))
+		return -ERESTARTSYS;
 
-	return len;
+	for (;;) {
+		if (set->merge)
+			ret = set_read_merged(set, buf, len);
+		else
+			ret = set_read_ready(set, buf, len);
+
+		if (ret)
+			break;
+
+		mutex_unlock(&set->mtx);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(set->wq, set_ready(set)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&set->mtx))
+			return -ERESTARTSYS;
+	}
 
-cleanup_cdev:
-	cdev_del(&topic->cdev);
-cleanup_topic:
-	kfree(topic);
+	mutex_unlock(&set->mtx);
 
-	return err;
+	return ret;
 }
 
-/* Delete a topic and release its resources. */
-static void delete_topic(struct topic *topic)
+static __poll_t set_poll(struct file *file, struct poll_table_struct *wait)
 {
-	release_minor_num(topic->dev.id);
-	list_del(&topic->entry);
-	device_unregister(&topic->dev);
-	cdev_del(&topic->cdev);
-	kfree(topic->buf);
-	kfree(topic);
+	struct kpub_set *set = file->private_data;
+
+	poll_wait(file, &set->wq, wait);
+
+	return set_ready(set) ? POLLIN | POLLRDNORM : 0;
 }
 
-/* Remove a topic by writing its name to the class attribute. */
-static ssize_t remove_topic_store(const struct class *cls,
-				  const struct class_attribute *attr,
-				  const char *buf, size_t len)
+/* Add or remove one topic by id, regardless of the set's patterns. */
+static int set_update(struct kpub_set *set, u32 __user *uid, bool add)
 {
-	struct topic *topic = NULL, *tp;
-	struct list_head *node;
+	struct kpub_member *m;
+	struct topic *topic;
+	int err = -ENOENT;
+	u32 id;
 
-	if (len >= MAX_STR_LEN) {
-		pr_alert("%s: topic too long, max %d bytes\n",
-			 THIS_MODULE->name, MAX_STR_LEN);
+	if (get_user(id, uid))
+		return -EFAULT;
+	if (id >= NUM_TOPICS)
 		return -EINVAL;
-	}
 
 	if (mutex_lock_interruptible(&topic_mtx))
 		return -ERESTARTSYS;
 
-	list_for_each(node, &topics) {
-		tp = node_to_topic(node);
-		if (strcmp(tp->name, buf) == 0) {
-			topic = tp;
+	topic = rcu_dereference_protected(topic_ids[id],
+					  lockdep_is_held(&topic_mtx));
+	if (!topic)
+		goto out;
+
+	if (add) {
+		/* Nothing is published to a split topic itself. */
+		err = topic->nparts ? -EINVAL : set_attach(set, topic);
+		goto out;
+	}
+
+	mutex_lock(&set->mtx);
+	list_for_each_entry(m, &set->members, entry) {
+		if (m->kf.topic == topic) {
+			member_detach(m);
+			err = 0;
 			break;
 		}
 	}
+	mutex_unlock(&set->mtx);
 
-	if (!topic) {
+out:
+	mutex_unlock(&topic_mtx);
+
+	return err;
+}
+
+/* Add a subscription pattern to a set and attach the topics it matches. */
+static int set_subscribe(struct kpub_set *set, const char __user *upattern)
+{
+	char pattern[KPUB_NAME_LEN];
+	struct kpub_pattern *p;
+	long len;
+
+	len = strncpy_from_user(pattern, upattern, sizeof(pattern));
+	if (len < 0)
+		return len;
+	if (len == sizeof(pattern))
+		return -ENAMETOOLONG;
+	if (!name_valid(pattern, true))
+		return -EINVAL;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	if (mutex_lock_interruptible(&topic_mtx)) {
+		kfree(p);
+		return -ERESTARTSYS;
+	}
+
+	p->node = trie_lookup(pattern, true);
+	if (!p->node) {
 		mutex_unlock(&topic_mtx);
-		return -ENODEV;
+		kfree(p);
+		return -ENOMEM;
 	}
 
-	delete_topic(topic);
+	p->set = set;
+	list_add_tail(&p->node_entry, &p->node->patterns);
+	list_add_tail(&p->set_entry, &set->patterns);
+
+	trie_match_topics(&trie_root, pattern, set);
 
 	mutex_unlock(&topic_mtx);
 
-	return len;
+	return 0;
 }
 
-/*
- * Default class sysfs attributes:
- *  - create_topic
- * 	- remove_topic
- */
-CLASS_ATTR_WO(create_topic);
-CLASS_ATTR_WO(remove_topic);
-static struct attribute *class_attrs[] = {
-	&class_attr_create_topic.attr,
-	&class_attr_remove_topic.attr,
-	NULL,
-};
-ATTRIBUTE_GROUPS(class);
-
-static struct class kpub_class = {
-	.name = "kpub",
-	.dev_groups = topic_groups,
-	.class_groups = class_groups,
-};
-
-/* Open the device for reading xor writing. */
-static int kpub_open(struct inode *inode, struct file *file)
+/* Switch a set between fair and globally ordered reads. */
+static int set_merge(struct kpub_set *set, u32 __user *umerge)
 {
-	struct topic *topic = cdev_to_topic(inode->i_cdev);
-	int err = 0;
+	u32 merge;
 
-	if (mutex_lock_interruptible(&topic->mtx))
+	if (get_user(merge, umerge))
+		return -EFAULT;
+
+	if (mutex_lock_interruptible(&set->mtx))
 		return -ERESTARTSYS;
+	set->merge = merge;
+	mutex_unlock(&set->mtx);
 
-	file->private_data = topic;
+	return 0;
+}
 
-	if (topic->msg_size == 0 || topic->msg_count == 0) {
-		dev_err(&topic->dev,
-			"set msg_size and msg_count before opening\n");
-		err = -ENOMEM;
-		goto cleanup;
-	}
+static long set_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct kpub_set *set = file->private_data;
 
-	if (!topic->buf) {
-		topic->buf = (char *)kzalloc(topic->msg_size * topic->msg_count,
-					     GFP_KERNEL);
-		if (!topic->buf) {
-			err = -ENOMEM;
-			goto cleanup;
-		}
+	switch (cmd) {
+	case KPUB_IOC_SUBSCRIBE:
+		return set_subscribe(set, (const char __user *)arg);
+	case KPUB_IOC_SET_ADD:
+		return set_update(set, (u32 __user *)arg, true);
+	case KPUB_IOC_SET_DEL:
+		return set_update(set, (u32 __user *)arg, false);
+	case KPUB_IOC_SET_MERGE:
+		return set_merge(set, (u32 __user *)arg);
+	default:
+		return -ENOTTY;
 	}
+}
 
-	if (file->f_mode & FMODE_READ && !(file->f_mode & FMODE_WRITE)) {
-		++topic->nreaders;
-	} else if (file->f_mode & FMODE_WRITE && !(file->f_mode & FMODE_READ)) {
-		++topic->nwriters;
-	} else {
-		dev_err(&topic->dev,
-			"topic must be opened as reader xor writer");
-		err = -EACCES;
-		goto cleanup;
-	}
+static const struct file_operations kpub_set_fops = {
+	.owner = THIS_MODULE,
+	.open = set_open,
+	.release = set_release,
+	.read = set_read,
+	.poll = set_poll,
+	.unlocked_ioctl = set_ioctl,
+};
 
-	topic->rp = topic->wp;
-	topic->len = 0;
+/* Subscription sets are read from /dev/kpub_sub. */
+static struct miscdevice kpub_set_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "kpub_sub",
+	.fops = &kpub_set_fops,
+};
 
-	dev_info(
-		&topic->dev,
-		"opening new file, nreaders = %lu, nwriters = %lu, offset = %lld\n",
-		topic->nreaders, topic->nwriters, file->f_pos);
+/*
+ * Pick the partition for a message published without sleeping, the way
+ * topic_publish_parts would. BPF callers hold no reference, so this runs
+ * under the producer lock, which partitions and keys are changed under, and
+ * checks the key against the message it was given. Called with the topic's
+ * lock held.
+ */
+static int topic_pick_part(struct topic *topic, const void *msg, size_t size,
+			   size_t *part)
+{
+	if (size != topic->msg_size)
+		return -EINVAL;
 
-cleanup:
-	mutex_unlock(&topic->mtx);
+	if (topic->lanes || !topic->key_len) {
+		*part = topic->lanes ? 0 :
+				       (u32)atomic_inc_return(&topic->rr) %
+					       topic->nparts;
+		return 0;
+	}
 
-	return err;
+	if (topic->key_len > size || topic->key_offset > size - topic->key_len)
+		return -EINVAL;
+
+	return topic_route(topic, msg, false, part);
 }
 
-static int kpub_release(struct inode *inode, struct file *file)
+/*
+ * Publish one message without sleeping, dropping it if the topic is full.
+ * Checks the buffer under the lock because BPF callers hold no reference
+ * that would keep the topic's geometry from changing. An NMI may have
+ * interrupted a holder of the lock on the same CPU, so in NMI context the
+ * lock is only tried, and readers are woken later from an irq_work.
+ */
+static int topic_publish_atomic(struct topic *topic, const void *msg,
+				size_t size)
 {
-	struct topic *topic = cdev_to_topic(inode->i_cdev);
+	struct topic *dst = NULL;
+	unsigned long flags;
+	size_t part;
 	int err = 0;
 
-	if (mutex_lock_interruptible(&topic->mtx))
-		return -ERESTARTSYS;
+	if (!in_nmi())
+		spin_lock_irqsave(&topic->lock, flags);
+	else if (!spin_trylock_irqsave(&topic->lock, flags))
+		return -EBUSY;
 
-	file->private_data = topic;
+	/* Detached partitions are only deleted once RCU readers are done. */
+	if (topic->nparts) {
+		err = topic_pick_part(topic, msg, size, &part);
+		if (!err)
+			dst = topic->parts[part];
+		goto cleanup;
+	}
 
-	if (file->f_mode & FMODE_READ && !(file->f_mode & FMODE_WRITE)) {
-		--topic->nreaders;
-	} else if (file->f_mode & FMODE_WRITE && !(file->f_mode & FMODE_READ)) {
-		--topic->nwriters;
-	} else {
-		dev_err(&topic->dev,
-			"topic must be opened as reader xor writer");
-		err = -EACCES;
+	if (!topic->buf || size != topic->msg_size) {
+		err = -EINVAL;
+		goto cleanup;
 	}
 
-	mutex_unlock(&topic->mtx);
+	if (topic_claim(topic, 1) == 0) {
+		++topic->dropped;
+		err = -ENOSPC;
+		goto cleanup;
+	}
+
+	memcpy(topic_slot(topic, topic->wp), msg, topic->msg_size);
+	topic_commit(topic, 1, 0);
+
+cleanup:
+	spin_unlock_irqrestore(&topic->lock, flags);
+
+	if (dst)
+		return topic_publish_atomic(dst, msg, size);
+
+	if (!err && in_nmi())
+		irq_work_queue(&topic->wake_work);
+	else if (!err)
+		topic_wake_readers(topic);
 
 	return err;
 }
 
-static ssize_t kpub_read(struct file *file, char __user *buf, size_t len,
-			 loff_t *off)
+/*
+ * Look up a topic by name for in-kernel use, allocating its buffer if needed.
+ * The topic's geometry is frozen until the reference is dropped with
+ * kpub_topic_put.
+ */
+struct topic *kpub_topic_get(const char *name)
 {
-	struct topic *topic = file->private_data;
-	size_t size = topic->msg_size * topic->msg_count;
+	struct topic *topic;
+	int err;
 
-	if (mutex_lock_interruptible(&topic->mtx))
-		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&topic_mtx))
+		return ERR_PTR(-ERESTARTSYS);
 
-	dev_info(&topic->dev, "reader is going to sleep...\n");
-	while (topic->len == 0) {
-		mutex_unlock(&topic->mtx);
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(topic->inq, topic->len > 0))
-			return -ERESTARTSYS;
-		if (mutex_lock_interruptible(&topic->mtx))
-			return -ERESTARTSYS;
-	}
+	topic = find_topic(name);
+	if (topic)
+		get_device(&topic->dev);
 
-	dev_info(&topic->dev, "reader has woken up!\n");
+	mutex_unlock(&topic_mtx);
 
-	if (topic->wp > topic->rp)
-		len = min(len, (size_t)(topic->wp - topic->rp));
-	else
-		len = min(len, (size_t)(size - topic->rp));
-
-	char test[MAX_STR_LEN];
-	snprintf(test, len, "%s", &topic->buf[*off]);
-	dev_info(&topic->dev,
-		 "copying %lu bytes to user space starting at %lu: %s\n", len,
-		 topic->rp, test);
-	if (copy_to_user(buf, &topic->buf[topic->rp], len)) {
-		mutex_unlock(&topic->mtx);
-		return -EFAULT;
-	}
+	if (!topic)
+		return ERR_PTR(-ENODEV);
 
-	--topic->rcount;
-	if (topic->rcount == 0) {
-		topic->rp += len;
-		if (topic->rp == size)
-			topic->rp = 0;
-		topic->len -= len;
+	mutex_lock(&topic->mtx);
+	err = topic_alloc_buf(topic);
+	if (!err) {
+		++topic->nkernel;
+		topic_hold_parts(topic, 1);
 	}
+	mutex_unlock(&topic->mtx);
 
-	dev_info(
-		&topic->dev,
-		"read: len = %lu, topic->rp = %lu, topic->len = %lu, topic->rcount = %lu\n",
-		len, topic->rp, topic->len, topic->rcount);
-
-	if (topic->len > 6) {
-		mutex_unlock(&topic->mtx);
-		return -EINVAL;
+	if (err) {
+		put_device(&topic->dev);
+		return ERR_PTR(err);
 	}
 
+	return topic;
+}
+EXPORT_SYMBOL_GPL(kpub_topic_get);
+
+/* Drop a reference taken with kpub_topic_get. */
+void kpub_topic_put(struct topic *topic)
+{
+	mutex_lock(&topic->mtx);
+	--topic->nkernel;
+	topic_hold_parts(topic, -1);
 	mutex_unlock(&topic->mtx);
 
-	wake_up_interruptible(&topic->outq);
+	put_device(&topic->dev);
+}
+EXPORT_SYMBOL_GPL(kpub_topic_put);
 
-	return len;
+/* Return the size of every message on the topic. */
+size_t kpub_topic_msg_size(struct topic *topic)
+{
+	return topic->msg_size;
 }
+EXPORT_SYMBOL_GPL(kpub_topic_msg_size);
 
-static ssize_t kpub_write(struct file *file, const char __user *buf, size_t len,
-			  loff_t *off)
+/* Publish a single msg_size message from a kernel buffer. */
+int kpub_publish(struct topic *topic, const void *msg, unsigned int flags)
 {
-	struct topic *topic = file->private_data;
-	size_t size = topic->msg_size * topic->msg_count;
+	ssize_t n = kpub_publish_batch(topic, msg, 1, flags);
+	return n < 0 ? n : 0;
+}
+EXPORT_SYMBOL_GPL(kpub_publish);
 
-	if (len % topic->msg_size) {
-		dev_err(&topic->dev,
-			"write length must be a multiple of msg_size\n");
-		return -EINVAL;
-	}
+/*
+ * Publish up to count contiguous msg_size messages from a kernel buffer.
+ * Returns the number of messages published, which may be fewer than count
+ * when the ring fills.
+ */
+ssize_t kpub_publish_batch(struct topic *topic, const void *msgs, size_t count,
+			   unsigned int flags)
+{
+	if (count == 0)
+		return 0;
 
-	if (len > size) {
-		dev_err(&topic->dev,
-			"cannot write more than msg_count messages\n");
-		return -EINVAL;
-	}
+	return topic_publish(topic, msgs, count, false, flags & KPUB_NONBLOCK,
+			     0);
+}
+EXPORT_SYMBOL_GPL(kpub_publish_batch);
 
-	if (mutex_lock_interruptible(&topic->mtx))
-		return -ERESTARTSYS;
+/*
+ * Publish a single msg_size message without sleeping. Safe to call from any
+ * context, NMI included. Partitioned topics route it like kpub_write, and
+ * topics with lanes publish it to lane 0. The
+ * message is dropped and counted if the topic is full; in NMI context it
+ * fails with -EBUSY if the topic is locked.
+ */
+int kpub_publish_atomic(struct topic *topic, const void *msg)
+{
+	return topic_publish_atomic(topic, msg, topic->msg_size);
+}
+EXPORT_SYMBOL_GPL(kpub_publish_atomic);
 
-	while (topic->len == size) {
-		mutex_unlock(&topic->mtx);
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		if (wait_event_interruptible(topic->outq, topic->len < size))
-			return -ERESTARTSYS;
-		if (mutex_lock_interruptible(&topic->mtx))
-			return -ERESTARTSYS;
-	}
+#if IS_ENABLED(CONFIG_BPF_SYSCALL)
+__bpf_kfunc_start_defs();
 
-	if (topic->wp >= *off)
-		len = min(len, (size_t)(size - topic->wp));
-	else
-		len = min(len, (size_t)(*off - topic->wp));
+/*
+ * Publish a message into the topic with the given id from a BPF program.
+ * data__sz must equal the topic's msg_size. Never sleeps; returns -ENOSPC
+ * and counts a drop when the topic is full, and -EBUSY from NMI context when
+ * the topic is locked.
+ */
+__bpf_kfunc int bpf_kpub_publish(u32 topic_id, const void *data, u32 data__sz)
+{
+	struct topic *topic;
+	int err = -ENODEV;
 
-	dev_info(&topic->dev,
-		 "copying %lu bytes from user space starting at %lu\n", len,
-		 topic->wp);
-	if (copy_from_user(&topic->buf[topic->wp], buf, len)) {
-		mutex_unlock(&topic->mtx);
-		return -EFAULT;
-	}
+	if (topic_id >= NUM_TOPICS)
+		return -ENODEV;
 
-	topic->wp += len;
-	if (topic->wp == size)
-		topic->wp = 0;
-	topic->len += len;
+	rcu_read_lock();
+	topic = rcu_dereference(topic_ids[topic_id]);
+	if (topic)
+		err = topic_publish_atomic(topic, data, data__sz);
+	rcu_read_unlock();
 
-	topic->rcount = topic->nreaders;
+	return err;
+}
 
-	dev_info(
-		&topic->dev,
-		"topic->len = %lu, topic->wp = %lu, topic->rcount = %lu, topic->rp = %lu\n",
-		topic->len, topic->wp, topic->rcount, topic->rp);
+__bpf_kfunc_end_defs();
 
-	mutex_unlock(&topic->mtx);
+BTF_KFUNCS_START(kpub_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_kpub_publish)
+BTF_KFUNCS_END(kpub_kfunc_ids)
 
-	wake_up_interruptible(&topic->inq);
+static const struct btf_kfunc_id_set kpub_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &kpub_kfunc_ids,
+};
 
-	return len;
+/* Program types allowed to call bpf_kpub_publish. */
+static const enum bpf_prog_type kpub_kfunc_prog_types[] = {
+	BPF_PROG_TYPE_KPROBE,
+	BPF_PROG_TYPE_TRACEPOINT,
+	BPF_PROG_TYPE_TRACING,
+	BPF_PROG_TYPE_XDP,
+	BPF_PROG_TYPE_SCHED_CLS,
+};
+
+/*
+ * Make bpf_kpub_publish available to BPF programs. Failure only disables BPF
+ * publishing, so it is logged rather than failing the module load.
+ */
+static void kpub_register_kfuncs(void)
+{
+	int err, i;
+
+	for (i = 0; i < ARRAY_SIZE(kpub_kfunc_prog_types); ++i) {
+		err = register_btf_kfunc_id_set(kpub_kfunc_prog_types[i],
+						&kpub_kfunc_set);
+		if (err) {
+			pr_alert("%s: could not register BPF kfuncs (%d)\n",
+				 THIS_MODULE->name, err);
+			return;
+		}
+	}
+}
+#else
+static void kpub_register_kfuncs(void)
+{
 }
+#endif
 
-static unsigned kpub_poll(struct file *file, poll_table *ppt)
+/* Register a callback invoked for every message published to the topic. */
+struct kpub_sub *kpub_subscribe_cb(struct topic *topic, kpub_cb_t cb,
+				   void *priv)
 {
-	struct topic *topic = file->private_data;
-	size_t size = topic->msg_size * topic->msg_count;
-	int ready_mask = 0;
+	struct kpub_sub *sub;
+
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub)
+		return ERR_PTR(-ENOMEM);
+
+	sub->topic = topic;
+	sub->cb = cb;
+	sub->priv = priv;
 
 	mutex_lock(&topic->mtx);
+	list_add_tail_rcu(&sub->entry, &topic->subs);
+	mutex_unlock(&topic->mtx);
 
-	poll_wait(file, &topic->inq, ppt);
-	poll_wait(file, &topic->outq, ppt);
+	return sub;
+}
+EXPORT_SYMBOL_GPL(kpub_subscribe_cb);
 
-	if (topic->len > 0)
-		ready_mask |= (POLLIN | POLLRDNORM);
-	if (topic->len == size)
-		ready_mask |= POLLOUT | POLLWRNORM;
+/* Unregister a callback. It is not running and will not run on return. */
+void kpub_unsubscribe(struct kpub_sub *sub)
+{
+	struct topic *topic = sub->topic;
 
+	mutex_lock(&topic->mtx);
+	list_del_rcu(&sub->entry);
 	mutex_unlock(&topic->mtx);
 
-	return ready_mask;
+	synchronize_rcu();
+	kfree(sub);
 }
-
-static struct file_operations kpub_fops = {
-	.owner = THIS_MODULE,
-	.open = kpub_open,
-	.release = kpub_release,
-	.read = kpub_read,
-	.write = kpub_write,
-	.poll = kpub_poll,
-};
+EXPORT_SYMBOL_GPL(kpub_unsubscribe);
 
 static int __init kpub_init(void)
 {
@@ -585,19 +6116,36 @@ static int __init kpub_init(void)
 		return err;
 	}
 
+	err = misc_register(&kpub_set_dev);
+	if (err) {
+		pr_alert("%s: could not register subscription device\n",
+			 THIS_MODULE->name);
+		class_unregister(&kpub_class);
+		unregister_chrdev_region(kpub_devt, NUM_TOPICS);
+		return err;
+	}
+
+	kpub_register_kfuncs();
+
 	return 0;
 }
 
 static void __exit kpub_exit(void)
 {
-	struct list_head *node, *tmp;
 	struct topic *topic;
 
-	list_for_each_safe(node, tmp, &topics) {
-		topic = node_to_topic(node);
-		delete_topic(topic);
+	/*
+	 * Deleting a topic also deletes its partitions, so partitions are
+	 * deleted through their parent rather than on their own.
+	 */
+	mutex_lock(&topic_mtx);
+	while (!list_empty(&topics)) {
+		topic = list_first_entry(&topics, struct topic, entry);
+		delete_topic(topic->parent ?: topic);
 	}
+	mutex_unlock(&topic_mtx);
 
+	misc_deregister(&kpub_set_dev);
 	class_unregister(&kpub_class);
 	unregister_chrdev_region(kpub_devt, NUM_TOPICS);
 }
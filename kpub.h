@@ -0,0 +1,274 @@
+#ifndef _KPUB_H
+#define _KPUB_H
+
+#include <linux/filter.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define KPUB_IOC_MAGIC 0xE5
+
+/*
+ * Attach a classic BPF filter to a reader fd. The filter runs on each message
+ * with 32-bit absolute loads (BPF_LD | BPF_W | BPF_ABS) reading from the
+ * message at 4-byte aligned offsets. Messages it returns zero for are skipped
+ * inside the kernel: they are never copied and do not wake a blocked reader.
+ */
+#define KPUB_IOC_SET_FILTER _IOW(KPUB_IOC_MAGIC, 1, struct sock_fprog)
+
+/* Detach a reader fd's BPF filter. */
+#define KPUB_IOC_CLEAR_FILTER _IO(KPUB_IOC_MAGIC, 2)
+
+/* Comparisons a content predicate can apply. */
+enum kpub_pred_op {
+	KPUB_PRED_EQ,
+	KPUB_PRED_NE,
+	KPUB_PRED_LT,
+	KPUB_PRED_GT,
+	KPUB_PRED_NR_OPS,
+};
+
+/*
+ * A content predicate for hosts that cannot load BPF. The native-endian 64-bit
+ * word at offset is masked and compared, unsigned, against value. offset + 8
+ * must not exceed msg_size; narrower fields are selected with the mask.
+ */
+struct kpub_pred {
+	__u32 offset;
+	__u32 op;
+	__u64 mask;
+	__u64 value;
+};
+
+#define KPUB_MAX_PREDS 16
+
+/* Predicates that must all hold for a message to be delivered. */
+struct kpub_pred_set {
+	__u32 count;
+	__u32 reserved;
+	__u64 preds; /* Pointer to count struct kpub_pred. */
+};
+
+/*
+ * Replace a reader fd's content predicates; a count of zero removes them.
+ * They are applied alongside any BPF filter, with the same skipping rules.
+ */
+#define KPUB_IOC_SET_PREDS _IOW(KPUB_IOC_MAGIC, 3, struct kpub_pred_set)
+
+/* Longest topic name or subscription pattern, including the NUL. */
+#define KPUB_NAME_LEN 64
+
+/*
+ * Subscribe a /dev/kpub_sub fd to every topic matching a pattern, now and as
+ * topics are created. Patterns are '/'-separated like topic names; a '+'
+ * segment matches any one segment and a final '#' matches any number,
+ * including none. A matching topic split into partitions or lanes is read
+ * through its partitions.
+ */
+#define KPUB_IOC_SUBSCRIBE _IOW(KPUB_IOC_MAGIC, 4, char[KPUB_NAME_LEN])
+
+/*
+ * Reads from a /dev/kpub_sub fd return records made of this tag followed by
+ * the message, padded to a multiple of 8 bytes. topic_id matches the topic's
+ * id attribute. seq orders the message among all messages published on any
+ * topic.
+ */
+struct kpub_tag {
+	__u32 topic_id;
+	__u32 size;
+	__u64 seq;
+};
+
+/*
+ * Add or remove one topic, given its id, to or from a /dev/kpub_sub fd.
+ * Adding a topic split into partitions or lanes fails with EINVAL; add its
+ * partitions instead.
+ */
+#define KPUB_IOC_SET_ADD _IOW(KPUB_IOC_MAGIC, 5, __u32)
+#define KPUB_IOC_SET_DEL _IOW(KPUB_IOC_MAGIC, 6, __u32)
+
+/*
+ * Make reads from a /dev/kpub_sub fd merge its topics in global publish
+ * order, by tag seq, when the argument is non-zero. By default topics are
+ * drained in turn, which is cheaper but only ordered within each topic.
+ */
+#define KPUB_IOC_SET_MERGE _IOW(KPUB_IOC_MAGIC, 7, __u32)
+
+/*
+ * Written in front of every message on topics with msg_header set. seq counts
+ * the topic's messages from zero, so a reader can spot the ones it missed; ns
+ * is CLOCK_MONOTONIC at publish time, and pid the publishing process, or 0 for
+ * publishers outside process context. len is the message length.
+ */
+struct kpub_hdr {
+	__u64 seq;
+	__u64 ns;
+	__u32 pid;
+	__u32 len;
+};
+
+/*
+ * Make reads on a reader fd return each message preceded by its struct
+ * kpub_hdr when the argument is non-zero. Fails with EINVAL if the topic's
+ * msg_header attribute is not set.
+ */
+#define KPUB_IOC_READ_HEADER _IOW(KPUB_IOC_MAGIC, 8, __u32)
+
+/*
+ * Move a reader fd to the first retained message published at or after the
+ * given CLOCK_MONOTONIC time in nanoseconds, or to the tail if there is none.
+ * The message's sequence number, which is also the new file position, is
+ * written back.
+ */
+#define KPUB_IOC_SEEK_TIME _IOWR(KPUB_IOC_MAGIC, 9, __u64)
+
+/*
+ * Return the generation of a snapshot topic's latest state, which counts the
+ * writes since its buffer was allocated. Reads on a reader fd return each
+ * generation once, so comparing this with the last one read tells whether a
+ * read would return anything new without copying the state.
+ */
+#define KPUB_IOC_SNAP_GEN _IOR(KPUB_IOC_MAGIC, 10, __u64)
+
+/*
+ * Make a reader fd a member of the named consumer group on its topic, which
+ * is created by its first member. Members share one cursor, so each message
+ * is read by exactly one of them, and a publish wakes one blocked member.
+ * Membership lasts until the fd is closed. Fails with EBUSY if the fd
+ * already has a filter or predicates, which do not apply to group reads, and
+ * with EINVAL if the topic has an ack timeout but not msg_header, since acks
+ * name messages by their header's sequence number.
+ */
+#define KPUB_IOC_JOIN_GROUP _IOW(KPUB_IOC_MAGIC, 11, char[KPUB_NAME_LEN])
+
+/* A batch of count sequence numbers to acknowledge, at seqs. */
+struct kpub_acks {
+	__u64 seqs;
+	__u32 count;
+	__u32 pad;
+};
+
+/*
+ * Acknowledge messages read through a consumer group on a topic with an ack
+ * timeout, by the sequence numbers in their headers. An unacked message keeps
+ * its slot and is redelivered to a member when the reader holding it closes
+ * its fd or does not ack it in time. Late acks for redelivered messages are
+ * ignored; sequence numbers not yet delivered fail with EINVAL.
+ */
+#define KPUB_IOC_ACK _IOW(KPUB_IOC_MAGIC, 12, struct kpub_acks)
+
+/*
+ * Attach a reader fd to the named durable cursor on its topic, creating it at
+ * the reader's position if it does not exist. An existing cursor moves the
+ * reader to its last committed position, or to the oldest retained message if
+ * that has been overwritten. A cursor has one reader at a time and outlives
+ * it; cursors are listed in the topic's cursors attribute.
+ */
+#define KPUB_IOC_CURSOR _IOW(KPUB_IOC_MAGIC, 13, char[KPUB_NAME_LEN])
+
+/*
+ * Commit a position, at most the reader's file position, to the reader's
+ * durable cursor. A reader reopening the cursor resumes there.
+ */
+#define KPUB_IOC_COMMIT _IOW(KPUB_IOC_MAGIC, 14, __u64)
+
+/*
+ * Token-bucket limits for a writer fd in messages and bytes per second, 0 for
+ * none, each allowing a burst of one second's worth. Rates are capped at
+ * U64_MAX / 10^9 per second. A write over the limit publishes what the limit
+ * allows, sleeping until that is at least one message; it fails with EAGAIN
+ * instead if reject is set or the fd is non-blocking. The topic's rate_msgs,
+ * rate_bytes and rate_policy attributes set a limit shared by all its writers
+ * on top.
+ */
+struct kpub_rate {
+	__u64 msgs;
+	__u64 bytes;
+	__u32 reject;
+	__u32 pad;
+};
+
+#define KPUB_IOC_SET_RATE _IOW(KPUB_IOC_MAGIC, 15, struct kpub_rate)
+
+/*
+ * Pick the priority lane a writer fd publishes to on a topic with lanes.
+ * Lanes are numbered from 0, the default and lowest priority; readers drain
+ * higher lanes first.
+ */
+#define KPUB_IOC_SET_LANE _IOW(KPUB_IOC_MAGIC, 16, __u32)
+
+/*
+ * Set the time to live in microseconds of messages a writer fd publishes
+ * from now on, overriding the topic's ttl_us attribute; 0 restores it.
+ * Readers skip messages older than their TTL without copying them.
+ */
+#define KPUB_IOC_SET_TTL _IOW(KPUB_IOC_MAGIC, 17, __u64)
+
+/*
+ * Hold the messages a writer fd publishes from now on until a CLOCK_MONOTONIC
+ * time in nanoseconds, then publish them in time order. Times already past,
+ * and 0, publish immediately. Held messages do not count against the ring,
+ * but a topic holds at most a ring's worth of bytes; writes past that fail
+ * with ENOSPC.
+ */
+#define KPUB_IOC_DELIVER_AT _IOW(KPUB_IOC_MAGIC, 18, __u64)
+
+/* A positioned read of up to len bytes at buf, from sequence number pos. */
+struct kpub_pread {
+	__u64 pos;
+	__u64 buf;
+	__u64 len;
+};
+
+/*
+ * Copy retained messages accepted by a reader fd's filters, from a sequence
+ * number onwards, without moving its cursor. Never blocks; returns the number
+ * of bytes copied, 0 at the tail. Positions outside the retained messages
+ * fail with ENXIO, and an eviction not yet reported by read(2) with EPIPE.
+ * pread(2) is not supported, since it cannot be told apart from a read at the
+ * cursor.
+ */
+#define KPUB_IOC_PREAD _IOW(KPUB_IOC_MAGIC, 19, struct kpub_pread)
+
+#ifdef __KERNEL__
+
+/*
+ * In-kernel interface to kpub topics. Kernel publishers and subscribers share
+ * a topic's ring with the user-space character device: messages published here
+ * are read through kpub_read, and messages written through kpub_write are
+ * delivered to kernel subscribers.
+ *
+ * kpub_topic_get, kpub_topic_put and the subscription calls may sleep.
+ * kpub_publish_atomic never does and may be called from any context, NMI
+ * included, where it fails with -EBUSY rather than wait for the topic's lock.
+ */
+
+struct topic;
+struct kpub_sub;
+
+/* Fail with -EAGAIN instead of sleeping when the topic is full. */
+#define KPUB_NONBLOCK 0x1
+
+/*
+ * Called once for every message published to a topic. The message points into
+ * the topic's ring and is only valid for the duration of the call. Callbacks
+ * run in the publisher's context, which may be NMI for BPF programs and
+ * kpub_publish_atomic, with the topic locked and must not sleep.
+ */
+typedef void (*kpub_cb_t)(void *priv, const void *msg, size_t size);
+
+struct topic *kpub_topic_get(const char *name);
+void kpub_topic_put(struct topic *topic);
+size_t kpub_topic_msg_size(struct topic *topic);
+
+int kpub_publish(struct topic *topic, const void *msg, unsigned int flags);
+ssize_t kpub_publish_batch(struct topic *topic, const void *msgs, size_t count,
+			   unsigned int flags);
+int kpub_publish_atomic(struct topic *topic, const void *msg);
+
+struct kpub_sub *kpub_subscribe_cb(struct topic *topic, kpub_cb_t cb,
+				   void *priv);
+void kpub_unsubscribe(struct kpub_sub *sub);
+
+#endif /* __KERNEL__ */
+
+#endif /* _KPUB_H */